@@ -109,19 +109,15 @@ static char* extract_exec_script(const char *text) {
         }
         
         // Extract the content
-        size_t content_len = end_content - start_content;
+        string_view_t content = string_view(start_content, end_content - start_content);
         
         // Add newline between blocks if not the first one
         if (found_any) {
             string_builder_append_str(&sb, "\n");
         }
         
-        // Add the content to our result
-        char *content = gc_malloc(&gc, content_len + 1);
-        memcpy(content, start_content, content_len);
-        content[content_len] = '\0';
-        
-        string_builder_append_str(&sb, content);
+        // Add the content to our result, straight from the response
+        string_builder_append_view(&sb, content);
         
         found_any = true;
         
@@ -137,42 +133,38 @@ static char* extract_exec_script(const char *text) {
     return string_builder_finalize(&sb);
 }
 
-// Helper function to truncate text to a maximum byte length
-static char* truncate_text(const char *text, size_t max_bytes, const char *truncation_note) {
-    if (!text || strlen(text) <= max_bytes) {
-        return gc_strdup(&gc, text ? text : "");
+// Helper function to truncate text to a maximum byte length, sharing the
+// text's buffers
+static rope_t truncate_text(const rope_t *text, size_t max_bytes, const char *truncation_note) {
+    rope_t r;
+    rope_init(&r, &gc);
+    if (text->size <= max_bytes) {
+        rope_append_rope(&r, text);
+        return r;
     }
     
     // Find a good truncation point (not in the middle of a line)
-    size_t truncate_at = max_bytes;
-    while (truncate_at > 0 && text[truncate_at] != '\n') {
-        truncate_at--;
-    }
+    size_t truncate_at = rope_rfind_char(text, max_bytes + 1, '\n');
     
     // If we couldn't find a newline, just use the max
-    if (truncate_at == 0) {
+    if (truncate_at == SIZE_MAX || truncate_at == 0) {
         truncate_at = max_bytes;
     }
     
-    string_builder_t sb;
-    string_builder_init(&sb, &gc, truncate_at + strlen(truncation_note) + 50);
-    
-    // Add the truncated text
-    char *truncated = gc_malloc(&gc, truncate_at + 1);
-    memcpy(truncated, text, truncate_at);
-    truncated[truncate_at] = '\0';
-    
-    string_builder_append_str(&sb, truncated);
-    string_builder_append_str(&sb, "\n\n");
-    string_builder_append_str(&sb, truncation_note);
+    rope_append_slice(&r, text, 0, truncate_at);
+    rope_append_str(&r, "\n\n");
+    rope_append_str(&r, truncation_note);
     
-    return string_builder_finalize(&sb);
+    return r;
 }
 
-// Helper function to truncate history if needed
-static char* truncate_history_if_needed(const char *history, size_t max_bytes) {
+// Helper function to truncate history if needed, the result points into it
+static rope_t truncate_history_if_needed(const char *history, size_t max_bytes) {
+    rope_t r;
+    rope_init(&r, &gc);
     if (!history || strlen(history) <= max_bytes) {
-        return gc_strdup(&gc, history ? history : "(none)");
+        rope_append_str(&r, history ? history : "(none)");
+        return r;
     }
     
     // For history, we want to keep the end (most recent output)
@@ -197,53 +189,48 @@ static char* truncate_history_if_needed(const char *history, size_t max_bytes) {
         start++;
     }
     
-    string_builder_t sb;
-    string_builder_init(&sb, &gc, max_bytes + 100);
-    
-    string_builder_append_str(&sb, "[... previous iteration truncated to fit context limits ...]\n\n");
-    string_builder_append_str(&sb, start);
+    rope_append_str(&r, "[... previous iteration truncated to fit context limits ...]\n\n");
+    rope_append_str(&r, start);
     
-    return string_builder_finalize(&sb);
+    return r;
 }
 
-static char* get_focused_content(char **files, int file_count) {
-    string_builder_t sb;
-    string_builder_init(&sb, &gc, 1024);
+// File contents are mapped rather than read, the rope owns the mappings
+static rope_t get_focused_content(const char **files, int file_count) {
+    rope_t r;
+    rope_init(&r, &gc);
     
     // Read file contents
     for (int i = 0; i < file_count; i++) {
         if (i > 0) {
-            string_builder_append_str(&sb, "\n\n");
+            rope_append_str(&r, "\n\n");
         }
         
-        string_builder_append_fmt(&sb, "--- %s ---\n", files[i]);
+        rope_append_fmt(&r, "--- %s ---\n", files[i]);
         
         char *bin_error = NULL;
         int is_binary = is_binary_file(files[i], &bin_error);
         
         if (is_binary == -1) {
             // Error checking if file is binary
-            string_builder_append_fmt(&sb, "[Error: %s]", bin_error ? bin_error : "Failed to check file");
+            rope_append_fmt(&r, "[Error: %s]", bin_error ? bin_error : "Failed to check file");
         } else if (is_binary == 1) {
             // File is binary
             struct stat st;
             if (stat(files[i], &st) == 0) {
-                string_builder_append_fmt(&sb, "[Binary data (%ld bytes)]", st.st_size);
+                rope_append_fmt(&r, "[Binary data (%ld bytes)]", st.st_size);
             } else {
-                string_builder_append_str(&sb, "[Binary data]");
+                rope_append_str(&r, "[Binary data]");
             }
         } else {
             char *error = NULL;
-            char *content = file_to_string(files[i], &error);
-            if (content) {
-                string_builder_append_str(&sb, content);
-            } else {
-                string_builder_append_fmt(&sb, "[Error reading file: %s]", error ? error : "Unknown error");
+            if (!rope_append_file(&r, files[i], &error)) {
+                rope_append_fmt(&r, "[Error reading file: %s]", error ? error : "Unknown error");
             }
         }
     }
     
-    return string_builder_finalize(&sb);
+    return r;
 }
 
 
@@ -260,110 +247,119 @@ typedef struct {
 typedef struct {
     const char *user_request;
     const AgentState *state;
-    const char *focused_files;
-    const char *history;
+    const rope_t *focused_files;
+    const rope_t *history;
     const char *extra_instructions;
 } PromptBuildArgs;
 
-// Build the prompt for the LLM
-static char* build_prompt(const PromptBuildArgs *args) {
-    string_builder_t sb;
-    string_builder_init(&sb, &gc, 4096);
+// Build the prompt for the LLM. The fixed text, the arguments and the
+// focused files are referenced, not copied.
+static rope_t build_prompt(const PromptBuildArgs *args) {
+    rope_t r;
+    rope_init(&r, &gc);
     
     // Add the prompt template content
-    string_builder_append_str(&sb, "You are an AI agent that is part of an outer execution loop.\n");
-    string_builder_append_str(&sb, "Your goal is to execute one shell script per iteration in order to accomplish a user task, or answer a user question.\n\n");
+    rope_append_str(&r, "You are an AI agent that is part of an outer execution loop.\n");
+    rope_append_str(&r, "Your goal is to execute one shell script per iteration in order to accomplish a user task, or answer a user question.\n\n");
     
-    string_builder_append_str(&sb, "# HOW TO EXECUTE SCRIPTS\n\n");
+    rope_append_str(&r, "# HOW TO EXECUTE SCRIPTS\n\n");
 
-    string_builder_append_str(&sb, "Output a single shell script in this format:\n\n");
+    rope_append_str(&r, "Output a single shell script in this format:\n\n");
 
-    string_builder_append_str(&sb, "exec\n```\n");
-    string_builder_append_str(&sb, "# Your POSIX shell script here\n");
-    string_builder_append_str(&sb, "```\n\n");
+    rope_append_str(&r, "exec\n```\n");
+    rope_append_str(&r, "# Your POSIX shell script here\n");
+    rope_append_str(&r, "```\n\n");
 
-    string_builder_append_str(&sb, "Your script will be run automatically at the end of your turn, and the output will be returned in the next iteration.\n");
-    string_builder_append_str(&sb, "Scripts run with -e (exit on error) and -x (debug trace) flags set.\n");
-    string_builder_append_str(&sb, "The exec code blocks support markdown delimiters (3+ ` or ~). Adjust the delimiters if your script contains backticks.\n\n");
+    rope_append_str(&r, "Your script will be run automatically at the end of your turn, and the output will be returned in the next iteration.\n");
+    rope_append_str(&r, "Scripts run with -e (exit on error) and -x (debug trace) flags set.\n");
+    rope_append_str(&r, "The exec code blocks support markdown delimiters (3+ ` or ~). Adjust the delimiters if your script contains backticks.\n\n");
 
-    string_builder_append_str(&sb, "# AGENT COMMANDS\n\n");
+    rope_append_str(&r, "# AGENT COMMANDS\n\n");
 
-    string_builder_append_str(&sb, "Special commands that control the agent loop are available in your scripts PATH (use them within exec blocks):\n\n");
-    string_builder_append_str(&sb, "- agent-files [FILES...] # Replace currently focused files (shown in every iteration, empty to clear)\n");
-    string_builder_append_str(&sb, "- agent-cd PATH          # Change working directory permanently (persists across iterations)\n");
-    string_builder_append_str(&sb, "- agent-abort            # Stop with failure (pipe message: echo \"reason\" | agent-abort)\n");
-    string_builder_append_str(&sb, "- agent-done             # Complete successfully (pipe message: echo \"summary\" | agent-done)\n\n");
+    rope_append_str(&r, "Special commands that control the agent loop are available in your scripts PATH (use them within exec blocks):\n\n");
+    rope_append_str(&r, "- agent-files [FILES...] # Replace currently focused files (shown in every iteration, empty to clear)\n");
+    rope_append_str(&r, "- agent-cd PATH          # Change working directory permanently (persists across iterations)\n");
+    rope_append_str(&r, "- agent-abort            # Stop with failure (pipe message: echo \"reason\" | agent-abort)\n");
+    rope_append_str(&r, "- agent-done             # Complete successfully (pipe message: echo \"summary\" | agent-done)\n\n");
     
-    string_builder_append_str(&sb, "# STATE MANAGEMENT\n\n");
+    rope_append_str(&r, "# STATE MANAGEMENT\n\n");
 
-    string_builder_append_str(&sb, "What persists between iterations:\n");
-    string_builder_append_str(&sb, "- Working directory (via agent-cd)\n");
-    string_builder_append_str(&sb, "- Focused files list (via agent-files)\n");
-    string_builder_append_str(&sb, "- Your own output and the script execution from the previous iteration\n\n");
-    string_builder_append_str(&sb, "What does NOT persist:\n");
-    string_builder_append_str(&sb, "- Shell variables\n");
-    string_builder_append_str(&sb, "- Current directory from 'cd' command\n");
-    string_builder_append_str(&sb, "- Output from older iteration\n\n");
-    
-    string_builder_append_str(&sb, "# PROGRESS TRACKING\n\n");
+    rope_append_str(&r, "What persists between iterations:\n");
+    rope_append_str(&r, "- Working directory (via agent-cd)\n");
+    rope_append_str(&r, "- Focused files list (via agent-files)\n");
+    rope_append_str(&r, "- Your own output and the script execution from the previous iteration\n\n");
+    rope_append_str(&r, "What does NOT persist:\n");
+    rope_append_str(&r, "- Shell variables\n");
+    rope_append_str(&r, "- Current directory from 'cd' command\n");
+    rope_append_str(&r, "- Output from older iteration\n\n");
+    
+    rope_append_str(&r, "# PROGRESS TRACKING\n\n");
 
-    string_builder_append_str(&sb, "Maintain a structured task list with clear status markers:\n\n");
+    rope_append_str(&r, "Maintain a structured task list with clear status markers:\n\n");
 
-    string_builder_append_str(&sb, "- [ ] Main task\n");
-    string_builder_append_str(&sb, "  - [✓] Completed subtask (verified in previous iteration)\n");
-    string_builder_append_str(&sb, "  - [→] Current subtask (what this script will do)\n");
-    string_builder_append_str(&sb, "  - [ ] Pending subtask (for future iterations)\n");
-    string_builder_append_str(&sb, "  - [✗] Failed subtask (needs retry or different approach)\n\n");
-    string_builder_append_str(&sb, "Only mark tasks [✓] complete AFTER seeing successful output, you shouldn't assume success.\n\n");
+    rope_append_str(&r, "- [ ] Main task\n");
+    rope_append_str(&r, "  - [✓] Completed subtask (verified in previous iteration)\n");
+    rope_append_str(&r, "  - [→] Current subtask (what this script will do)\n");
+    rope_append_str(&r, "  - [ ] Pending subtask (for future iterations)\n");
+    rope_append_str(&r, "  - [✗] Failed subtask (needs retry or different approach)\n\n");
+    rope_append_str(&r, "Only mark tasks [✓] complete AFTER seeing successful output, you shouldn't assume success.\n\n");
 
-    string_builder_append_str(&sb, "# TASK COMPLETION\n\n");
+    rope_append_str(&r, "# TASK COMPLETION\n\n");
 
-    string_builder_append_str(&sb, "- You should only run the `agent-done` command when the original user request is satisfied\n");
-    string_builder_append_str(&sb, "- Supply a message agent-done to answer the user questions or explain what was achieved\n");
-    string_builder_append_str(&sb, "- It is easier for the user to read the agent-done message than any execution output\n\n");
+    rope_append_str(&r, "- You should only run the `agent-done` command when the original user request is satisfied\n");
+    rope_append_str(&r, "- Supply a message agent-done to answer the user questions or explain what was achieved\n");
+    rope_append_str(&r, "- It is easier for the user to read the agent-done message than any execution output\n\n");
 
-    string_builder_append_str(&sb, "# ERROR HANDLING\n\n");
+    rope_append_str(&r, "# ERROR HANDLING\n\n");
 
-    string_builder_append_str(&sb, "When your exec script fails:\n");
-    string_builder_append_str(&sb, "- Examine the -x trace output to identify the failing command\n");
-    string_builder_append_str(&sb, "- Check exit codes and error messages\n");
-    string_builder_append_str(&sb, "- Consider aborting with agent-abort if the task cannot proceed\n\n");
+    rope_append_str(&r, "When your exec script fails:\n");
+    rope_append_str(&r, "- Examine the -x trace output to identify the failing command\n");
+    rope_append_str(&r, "- Check exit codes and error messages\n");
+    rope_append_str(&r, "- Consider aborting with agent-abort if the task cannot proceed\n\n");
     
-    string_builder_append_str(&sb, "# BEST PRACTICES\n\n");
+    rope_append_str(&r, "# BEST PRACTICES\n\n");
 
-    string_builder_append_str(&sb, "- State clearly what your script will attempt\n");
-    string_builder_append_str(&sb, "- Focus files you'll need to reference in future iterations\n");
-    string_builder_append_str(&sb, "- Mention important information for use in the next iteration\n");
-    string_builder_append_str(&sb, "- Break complex tasks into smaller, verifiable steps\n");
-    string_builder_append_str(&sb, "- Try to accomplish steps each iteration in logical chunks\n");
-    string_builder_append_str(&sb, "- Verify outputs before proceeding (verify success in the next iteration)\n");
-    string_builder_append_str(&sb, "- Track your own progress via notes (you can only see the output of the last iteration)\n\n");
+    rope_append_str(&r, "- State clearly what your script will attempt\n");
+    rope_append_str(&r, "- Focus files you'll need to reference in future iterations\n");
+    rope_append_str(&r, "- Mention important information for use in the next iteration\n");
+    rope_append_str(&r, "- Break complex tasks into smaller, verifiable steps\n");
+    rope_append_str(&r, "- Try to accomplish steps each iteration in logical chunks\n");
+    rope_append_str(&r, "- Verify outputs before proceeding (verify success in the next iteration)\n");
+    rope_append_str(&r, "- Track your own progress via notes (you can only see the output of the last iteration)\n\n");
     
     // Add custom instructions if provided
     if (args->extra_instructions && strlen(args->extra_instructions) > 0) {
-        string_builder_append_str(&sb, "# CUSTOM INSTRUCTIONS\n\n");
-        string_builder_append_str(&sb, args->extra_instructions);
+        rope_append_str(&r, "# CUSTOM INSTRUCTIONS\n\n");
+        rope_append_str(&r, args->extra_instructions);
         
         // Ensure there's at least one newline after instructions
         size_t len = strlen(args->extra_instructions);
         if (len > 0 && args->extra_instructions[len - 1] != '\n') {
-            string_builder_append_str(&sb, "\n");
+            rope_append_str(&r, "\n");
         }
         // Always add an extra newline for spacing
-        string_builder_append_str(&sb, "\n");
+        rope_append_str(&r, "\n");
     }
     
-    string_builder_append_str(&sb, "--- CURRENT STATE ---\n\n");
+    rope_append_str(&r, "--- CURRENT STATE ---\n\n");
     
-    string_builder_append_fmt(&sb, "User query/request:\n\n%s\n\n", args->user_request);
+    rope_append_str(&r, "User query/request:\n\n");
+    rope_append_str(&r, args->user_request);
+    rope_append_str(&r, "\n\n");
     
-    string_builder_append_fmt(&sb, "Working directory:\n\n%s\n\n", args->state->working_dir);
+    rope_append_str(&r, "Working directory:\n\n");
+    // NULL when getcwd failed and no directory was given
+    rope_append_str(&r, args->state->working_dir ? args->state->working_dir : "(unknown)");
+    rope_append_str(&r, "\n\n");
     
-    string_builder_append_fmt(&sb, "Focused files:\n\n%s\n\n", args->focused_files);
+    rope_append_str(&r, "Focused files:\n\n");
+    rope_append_rope(&r, args->focused_files);
+    rope_append_str(&r, "\n\n");
     
-    string_builder_append_fmt(&sb, "Last iteration:\n\n%s", args->history);
+    rope_append_str(&r, "Last iteration:\n\n");
+    rope_append_rope(&r, args->history);
     
-    return string_builder_finalize(&sb);
+    return r;
 }
 
 // Callback function to handle model output streaming
@@ -413,28 +409,40 @@ static void output_callback(const char *chunk, size_t chunk_len, model_chunk_typ
     }
 }
 
+// Copy the state that outlives an iteration out of its allocation region.
+// Paths and the working directory are interned and live outside it.
+static void escape_iteration_state(AgentState *state, AgentCommandState *cmd_state) {
+    state->prev_iteration = gc_region_escape(&gc, state->prev_iteration);
+    state->done_message = gc_region_escape(&gc, state->done_message);
+    state->abort_message = gc_region_escape(&gc, state->abort_message);
+    state->focused_files = gc_region_escape(&gc, state->focused_files);
+    
+    cmd_state->working_dir = state->working_dir;
+    cmd_state->focused_files = state->focused_files;
+    cmd_state->focused_files_count = state->focused_files_count;
+}
+
 AgentResult run_agent(AgentArgs *args) {
     AgentState state = {0};
     AgentCommandState cmd_state = {0};
     
     // Initialize working directory
     if (args->working_dir) {
-        state.working_dir = gc_strdup(&gc, args->working_dir);
-        cmd_state.working_dir = gc_strdup(&gc, args->working_dir);
+        state.working_dir = string_intern(args->working_dir);
     } else {
         char cwd[4096];
         if (getcwd(cwd, sizeof(cwd))) {
-            state.working_dir = gc_strdup(&gc, cwd);
-            cmd_state.working_dir = gc_strdup(&gc, cwd);
+            state.working_dir = string_intern(cwd);
         }
     }
+    cmd_state.working_dir = state.working_dir;
     
     // Process initial focus files
     if (args->initial_focus_count > 0) {
         // Copy the already-expanded paths from args
         state.focused_files = gc_malloc(&gc, args->initial_focus_count * sizeof(char*));
         for (int i = 0; i < args->initial_focus_count; i++) {
-            state.focused_files[i] = gc_strdup(&gc, args->initial_focus[i]);
+            state.focused_files[i] = string_intern(args->initial_focus[i]);
         }
         state.focused_files_count = args->initial_focus_count;
         
@@ -456,15 +464,19 @@ AgentResult run_agent(AgentArgs *args) {
     }
     
     // Generate a dummy prompt once to get exact system prompt size
+    rope_t no_files, no_history;
+    rope_init(&no_files, &gc);
+    rope_append_str(&no_files, "(none)");
+    rope_init(&no_history, &gc);
     PromptBuildArgs dummy_args = {
         .user_request = args->user_request,
         .state = &state,
-        .focused_files = "(none)",
-        .history = "",
+        .focused_files = &no_files,
+        .history = &no_history,
         .extra_instructions = args->extra_instructions
     };
-    char *dummy_prompt = build_prompt(&dummy_args);
-    size_t system_prompt_size = strlen(dummy_prompt);
+    rope_t dummy_prompt = build_prompt(&dummy_args);
+    size_t system_prompt_size = dummy_prompt.size;
     
     while (!state.done && !state.aborted && state.iteration < args->max_iterations) {
         // Check for cancellation
@@ -475,6 +487,10 @@ AgentResult run_agent(AgentArgs *args) {
         
         state.iteration++;
         
+        // Everything the iteration allocates is released in one go at its
+        // end, apart from the state escaped for the next one
+        gc_region_begin(&gc);
+        
         // String builder for current iteration's entry
         string_builder_t iteration_sb;
         string_builder_init(&iteration_sb, &gc, 1024);
@@ -484,6 +500,7 @@ AgentResult run_agent(AgentArgs *args) {
         // Formula: tokens * 4 bytes/token * 0.9 safety margin / 2 for input/output split
         if (model->max_tokens == 0) {
             fprintf(args->output, "Error: Model '%s' does not specify max_tokens\n", model->name);
+            gc_region_end(&gc);
             return AGENT_RESULT_ERROR;
         }
         size_t max_context_bytes = (size_t)(model->max_tokens * 4 * 0.9 / 2);
@@ -497,52 +514,56 @@ AgentResult run_agent(AgentArgs *args) {
         size_t focused_files_budget = available_bytes * 40 / 100;
         size_t initial_history_budget = available_bytes * 60 / 100;
         
-        // Get focused files content
-        char *focused_files_full = "(none)";
-        char *focused_files = "(none)";
-        size_t focused_files_actual_size = 0;
+        // Get focused files content. The files stay mapped until the
+        // prompt has been flattened, truncation only drops segments.
+        rope_t focused_files_full;
+        rope_t focused_files;
         
         if (state.focused_files_count > 0) {
             focused_files_full = get_focused_content(state.focused_files, 
                                                     state.focused_files_count);
-            focused_files_actual_size = strlen(focused_files_full);
             
-            if (focused_files_actual_size > focused_files_budget) {
-                focused_files = truncate_text(focused_files_full, focused_files_budget,
+            if (focused_files_full.size > focused_files_budget) {
+                focused_files = truncate_text(&focused_files_full, focused_files_budget,
                     "[NOTE: Focused files were truncated to fit context limits. Consider focusing on fewer or smaller files.]");
-                // Update actual size to reflect the truncated content + note
-                focused_files_actual_size = strlen(focused_files);
             } else {
                 focused_files = focused_files_full;
             }
         } else {
-            focused_files_actual_size = strlen("(none)");
+            rope_init(&focused_files_full, &gc);
+            rope_append_str(&focused_files_full, "(none)");
+            focused_files = focused_files_full;
         }
+        size_t focused_files_full_size = focused_files_full.size;
+        size_t focused_files_actual_size = focused_files.size;
 
         // Extend history budget with unused focused files space
         size_t unused_files_budget = focused_files_budget - focused_files_actual_size;
         size_t history_budget = initial_history_budget + unused_files_budget;
         
         // Get history from previous iteration with truncation if needed
-        char *history = truncate_history_if_needed(state.prev_iteration, history_budget);
+        rope_t history = truncate_history_if_needed(state.prev_iteration, history_budget);
         
-        // Build prompt using the dedicated function
+        // Build prompt using the dedicated function, the one copy of the
+        // context is made here
         PromptBuildArgs prompt_args = {
             .user_request = args->user_request,
             .state = &state,
-            .focused_files = focused_files,
-            .history = history,
+            .focused_files = &focused_files,
+            .history = &history,
             .extra_instructions = args->extra_instructions
         };
-        char *prompt = build_prompt(&prompt_args);
+        rope_t prompt_rope = build_prompt(&prompt_args);
+        char *prompt = rope_flatten(&prompt_rope);
+        rope_release(&focused_files_full);
         
         // Print and build the iteration header
         // Only add newline before header if it's not the first iteration
-        const char *iteration_header;
+        char iteration_header[64];
         if (state.iteration > 1) {
-            iteration_header = gc_asprintf(&gc, "\n=== Iteration %d ===\n", state.iteration);
+            snprintf(iteration_header, sizeof(iteration_header), "\n=== Iteration %d ===\n", state.iteration);
         } else {
-            iteration_header = gc_asprintf(&gc, "=== Iteration %d ===\n", state.iteration);
+            snprintf(iteration_header, sizeof(iteration_header), "=== Iteration %d ===\n", state.iteration);
         }
         fprintf(args->output, "%s", iteration_header);
         string_builder_append_str(&iteration_sb, iteration_header);
@@ -553,7 +574,7 @@ AgentResult run_agent(AgentArgs *args) {
             fprintf(args->output, "Base prompt size: %zu bytes\n", system_prompt_size);
             fprintf(args->output, "Available for content: %zu bytes\n", available_bytes);
             fprintf(args->output, "Focused files size: %zu bytes (budget: %zu, used: %zu)\n", 
-                    strlen(focused_files_full), focused_files_budget, focused_files_actual_size);
+                    focused_files_full_size, focused_files_budget, focused_files_actual_size);
             
             // Calculate previous iteration size
             size_t prev_iteration_size = state.prev_iteration ? strlen(state.prev_iteration) : 0;
@@ -595,6 +616,7 @@ AgentResult run_agent(AgentArgs *args) {
         
         if (!response) {
             fprintf(args->output, "Error: Failed to get model response: %s\n", error ? error : "Unknown error");
+            gc_region_end(&gc);
             return AGENT_RESULT_ERROR;
         }
         
@@ -630,6 +652,8 @@ AgentResult run_agent(AgentArgs *args) {
         
         // Store this iteration for the next iteration to see
         state.prev_iteration = string_builder_finalize(&iteration_sb);
+        escape_iteration_state(&state, &cmd_state);
+        gc_region_end(&gc);
     }
     
     if (state.done) {
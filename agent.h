@@ -14,7 +14,7 @@ typedef struct {
 } PromptData;
 
 typedef struct {
-    char **focused_files;
+    const char **focused_files;  // Interned paths
     int focused_files_count;
     
     // Previous iteration data (what the model sees from last run)
@@ -25,7 +25,7 @@ typedef struct {
     char *done_message;
     bool aborted;
     char *abort_message;
-    char *working_dir;
+    const char *working_dir;  // Interned
 } AgentState;
 
 typedef struct {
@@ -43,9 +43,9 @@ typedef struct {
 } AgentArgs;
 
 typedef struct {
-    char **focused_files;
+    const char **focused_files;
     int focused_files_count;
-    char *working_dir;
+    const char *working_dir;
 } AgentCommandState;
 
 typedef enum {
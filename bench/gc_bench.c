@@ -0,0 +1,255 @@
+// GC microbenchmarks: synthetic workloads shaped like minicoder's own
+// allocation patterns. Each workload runs in a child process for a fixed
+// time and reports allocations per second, collection pauses and peak RSS.
+//
+// Usage: gc_bench [workload...]   (all of them by default)
+// MINICODER_DEBUG_STRESS_GC=1 collects on every allocation and
+// MINICODER_GC_BACKGROUND_SWEEP=1 sweeps on a thread, as in minicoder.
+// BENCH_SECONDS sets the time per workload (default 1).
+
+#define _GNU_SOURCE
+#include "gc.h"
+#include "string.h"
+#include <cJSON.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+gc_state gc;
+
+static size_t allocs;       // Allocations made by the current workload
+static double *pauses;      // Durations of operations that contained a pause
+static size_t pause_count;
+static size_t pause_capacity;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Same node layout and hooks as main.c
+static const gc_layout cjson_layout = {
+    .size = sizeof(cJSON),
+    .ptr_words = GC_LAYOUT_FIELD(cJSON, next) | GC_LAYOUT_FIELD(cJSON, prev) |
+                 GC_LAYOUT_FIELD(cJSON, child) | GC_LAYOUT_FIELD(cJSON, valuestring) |
+                 GC_LAYOUT_FIELD(cJSON, string),
+};
+
+static void *cjson_malloc_hook(size_t size) {
+    allocs++;
+    return size != sizeof(cJSON) ? gc_malloc_atomic(&gc, size) :
+                                   gc_malloc_typed(&gc, size, &cjson_layout);
+}
+
+static void cjson_free_hook(void *ptr) {
+    (void)ptr;
+}
+
+// Append through a string builder, counting the growth it causes
+static void sb_append(string_builder_t *sb, const char *s, size_t len) {
+    size_t capacity = sb->capacity;
+    string_builder_append(sb, s, len);
+    if (sb->capacity != capacity) allocs++;
+}
+
+// ---- Workloads -------------------------------------------------------------
+// Each is one operation, called repeatedly. Live data is kept in rings of
+// roots so the heap reaches a steady state with some long lived objects.
+
+#define RING 64
+
+static void *ring[RING];
+static size_t ring_pos;
+
+static void keep(void *p) {
+    ring[ring_pos++ % RING] = p;
+}
+
+// Prompt and output building: a string grown from small pieces by doubling
+static void op_string_builder(unsigned i) {
+    string_builder_t sb;
+    string_builder_init(&sb, &gc, 64);
+    allocs++;
+    char piece[160];
+    for (unsigned k = 0; k < 200; k++) {
+        int len = snprintf(piece, sizeof(piece), "line %u of message %u: %.*s\n", k, i,
+                           (int)((i + k) % 100), "lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor incididunt ut labore");
+        sb_append(&sb, piece, (size_t)len);
+    }
+    keep(string_builder_finalize(&sb));
+}
+
+// Request building and response parsing: many small nodes
+static void op_cjson_nodes(unsigned i) {
+    cJSON *request = cJSON_CreateObject();
+    cJSON_AddStringToObject(request, "model", "bench-model");
+    cJSON *messages = cJSON_AddArrayToObject(request, "messages");
+    for (unsigned k = 0; k < 16; k++) {
+        cJSON *m = cJSON_CreateObject();
+        cJSON_AddStringToObject(m, "role", k % 2 ? "assistant" : "user");
+        cJSON_AddStringToObject(m, "content", "Please read the file and summarise the parts that matter.");
+        cJSON_AddNumberToObject(m, "index", k + i);
+        cJSON_AddItemToArray(messages, m);
+    }
+    char *body = cJSON_PrintUnformatted(request);
+    cJSON *parsed = cJSON_Parse(body);
+    keep(i % 8 ? (void*)body : (void*)parsed);
+}
+
+// Token streaming: per-line JSON parsing with a growing response buffer
+static string_builder_t sse_response;
+
+static void op_sse_lines(unsigned i) {
+    if (i % 500 == 0) {
+        string_builder_init(&sse_response, &gc, 1024);
+        allocs++;
+        keep(sse_response.data);
+    }
+    char line[256];
+    snprintf(line, sizeof(line),
+             "{\"id\":\"chatcmpl-%u\",\"choices\":[{\"index\":0,\"delta\":{\"content\":\"token %u \"}}]}",
+             i / 500, i);
+    cJSON *chunk = cJSON_Parse(line);
+    cJSON *choices = cJSON_GetObjectItem(chunk, "choices");
+    cJSON *delta = cJSON_GetObjectItem(cJSON_GetArrayItem(choices, 0), "delta");
+    cJSON *content = cJSON_GetObjectItem(delta, "content");
+    if (content && cJSON_IsString(content))
+        sb_append(&sse_response, content->valuestring, strlen(content->valuestring));
+}
+
+// File contents read into large buffers
+static void op_file_buffers(unsigned i) {
+    size_t size = (size_t)4096 << (i % 10);  // 4KB to 2MB
+    char *buf = gc_malloc_atomic(&gc, size);
+    allocs++;
+    memset(buf, 'x', size);
+    if (i % 4 == 0) keep(buf);
+}
+
+// Deep linked structures: long lists built a node at a time, then dropped
+typedef struct node {
+    struct node *next;
+    char *text;
+    size_t n;
+} node;
+
+static node *list;
+
+static void op_linked_lists(unsigned i) {
+    if (i % 1000 == 0) list = NULL;
+    for (unsigned k = 0; k < 64; k++) {
+        node *n = gc_malloc(&gc, sizeof(node));
+        n->text = gc_strdup(&gc, "entry");
+        n->n = i;
+        n->next = list;
+        list = n;
+        allocs += 2;
+    }
+}
+
+typedef struct workload {
+    const char *name;
+    void (*op)(unsigned i);
+} workload;
+
+static const workload workloads[] = {
+    { "string_builder", op_string_builder },
+    { "cjson_nodes", op_cjson_nodes },
+    { "sse_lines", op_sse_lines },
+    { "file_buffers", op_file_buffers },
+    { "linked_lists", op_linked_lists },
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+// ---- Driver ----------------------------------------------------------------
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double p) {
+    if (!pause_count) return 0;
+    size_t k = (size_t)(p * (pause_count - 1) + 0.5);
+    return pauses[k];
+}
+
+// Run a workload for the given time, in a process of its own
+static void run(const workload *w, double seconds) {
+    void *stack_bottom;
+    GC_GET_STACK_POINTER(&stack_bottom);
+    gc_init(&gc, stack_bottom);
+    const char *stress_env = getenv("MINICODER_DEBUG_STRESS_GC");
+    if (stress_env && strcmp(stress_env, "1") == 0) gc.debug_stress = 1;
+    const char *sweep_env = getenv("MINICODER_GC_BACKGROUND_SWEEP");
+    if (sweep_env && strcmp(sweep_env, "1") == 0) gc.background_sweep = true;
+    gc_add_root(&gc, ring, sizeof(ring));
+    gc_add_root(&gc, &list, sizeof(list));
+    gc_add_root(&gc, &sse_response, sizeof(sse_response));
+    cJSON_Hooks hooks = { cjson_malloc_hook, cjson_free_hook };
+    cJSON_InitHooks(&hooks);
+
+    // An operation during which a pause happened is timed as the pause
+    double start = now_us(), end = start + seconds * 1e6, t = start;
+    unsigned i = 0;
+    while (t < end) {
+        size_t before = gc.stats.pauses;
+        double op_start = t;
+        w->op(i++);
+        t = now_us();
+        if (gc.stats.pauses != before) {
+            if (pause_count >= pause_capacity) {
+                pause_capacity = pause_capacity ? pause_capacity * 2 : 1024;
+                pauses = realloc(pauses, pause_capacity * sizeof(double));
+                if (!pauses) { fprintf(stderr, "gc_bench: OOM\n"); exit(1); }
+            }
+            pauses[pause_count++] = t - op_start;
+        }
+    }
+    double elapsed = (t - start) / 1e6;
+
+    qsort(pauses, pause_count, sizeof(double), compare_double);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%-15s %12.0f allocs/s  pause p50 %9.1fus p99 %9.1fus max %9.1fus (%6zu)  peak RSS %7.1fMB\n",
+           w->name, allocs / elapsed, percentile(0.5), percentile(0.99),
+           pause_count ? pauses[pause_count - 1] : 0.0, pause_count, ru.ru_maxrss / 1024.0);
+    fflush(stdout);
+    gc_cleanup(&gc);
+}
+
+int main(int argc, char *argv[]) {
+    const char *seconds_env = getenv("BENCH_SECONDS");
+    double seconds = seconds_env && atof(seconds_env) > 0 ? atof(seconds_env) : 1.0;
+    const char *stress_env = getenv("MINICODER_DEBUG_STRESS_GC");
+    printf("GC benchmarks, %.1fs per workload%s\n", seconds,
+           stress_env && strcmp(stress_env, "1") == 0 ? ", stress mode" : "");
+
+    int failed = 0;
+    for (size_t k = 0; k < WORKLOAD_COUNT; k++) {
+        bool wanted = argc == 1;
+        for (int a = 1; a < argc; a++)
+            if (strcmp(argv[a], workloads[k].name) == 0) wanted = true;
+        if (!wanted) continue;
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == -1) { perror("gc_bench: fork"); return 1; }
+        if (pid == 0) {
+            run(&workloads[k], seconds);
+            _exit(0);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "gc_bench: %s failed\n", workloads[k].name);
+            failed = 1;
+        }
+    }
+    return failed;
+}
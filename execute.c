@@ -36,7 +36,7 @@ static char* shell_escape_single_quotes(const char *str) {
     
     // Allocate space: original length + (3 extra chars per quote) + null terminator
     size_t new_len = strlen(str) + (quote_count * 3) + 1;
-    char *result = gc_malloc(&gc, new_len);
+    char *result = gc_malloc_atomic(&gc, new_len);
     
     char *out = result;
     for (const char *p = str; *p; p++) {
@@ -151,21 +151,29 @@ static void read_state_json(const char *path, AgentState *state, AgentCommandSta
     // Update working directory
     cJSON *wd = cJSON_GetObjectItem(root, "working_dir");
     if (wd && cJSON_IsString(wd)) {
-        // gc doesn't have explicit free
-        state->working_dir = gc_strdup(&gc, cJSON_GetStringValue(wd));
+        state->working_dir = string_intern(cJSON_GetStringValue(wd));
         cmd_state->working_dir = state->working_dir;
     }
     
-    // Update focused files
+    // Update focused files. Paths are interned, so an unchanged list is
+    // recognised by pointer comparison and kept without a new array.
     cJSON *focused = cJSON_GetObjectItem(root, "focused_files");
     if (focused && cJSON_IsArray(focused)) {
         int new_count = cJSON_GetArraySize(focused);
-        char **new_files = gc_malloc(&gc, new_count * sizeof(char*));
+        bool unchanged = new_count == state->focused_files_count;
+        int i = 0;
+        for (cJSON *item = focused->child; unchanged && item; item = item->next, i++) {
+            unchanged = string_intern(cJSON_GetStringValue(item)) == state->focused_files[i];
+        }
+        if (unchanged) {
+            return;
+        }
         
-        for (int i = 0; i < new_count; i++) {
-            cJSON *item = cJSON_GetArrayItem(focused, i);
-            if (item && cJSON_IsString(item)) {
-                new_files[i] = gc_strdup(&gc, cJSON_GetStringValue(item));
+        const char **new_files = gc_malloc(&gc, new_count * sizeof(char*));
+        i = 0;
+        for (cJSON *item = focused->child; item; item = item->next, i++) {
+            if (cJSON_IsString(item)) {
+                new_files[i] = string_intern(cJSON_GetStringValue(item));
             }
         }
         
@@ -330,6 +338,10 @@ char* execute_agent_script(const char *script, AgentState *state, AgentCommandSt
     // Parent process
     close(pipefd[1]);  // Close write end
     
+    // Collect now, while the script runs, rather than in the middle of
+    // the next model request
+    gc_idle(&gc);
+    
     // Read output from pipe
     string_builder_t sb;
     string_builder_init(&sb, &gc, 4096);
@@ -1,4 +1,5 @@
 
+#define _GNU_SOURCE
 #include "gc.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -7,19 +8,185 @@
 #include <stdbool.h>
 #include <setjmp.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // ---- Tunables --------------------------------------------------------------
 
 #define DEFAULT_GC_THRESHOLD (512*1024)
 #define GC_INITIAL_ROOTS 16
 #define GC_INITIAL_ALLOC_SIZE 256
+#define GC_INITIAL_MARK_STACK 1024
+#define GC_MARK_SLICE_BYTES 4096    // Large objects are scanned in slices of this size
+#define GC_PREFETCH_DISTANCE 8      // Popped ranges wait this long for their prefetch
+#define GC_SCAN_BATCH 16            // Candidate pointers looked up together
+#define GC_FILTER_SHIFT 20          // Address space covered by one scan filter bit (1MB)
+#define GC_FILTER_BITS (1 << 16)    // Scan filter size, block numbers wrap around it
+#define GC_RADIX_BITS 8             // Address bits per radix sort pass
+#define GC_STEP_ENTRIES 1024        // Setup/sweep entries handled per unit of work
+#define GC_STEP_RANGES 64           // Mark ranges scanned per unit of work
+#define GC_STEP_PAGES 4             // Pages swept per unit of work
+#define GC_STEP_ALLOC_BYTES (64*1024) // Allocation between incremental steps
+#define GC_VDB_WINDOW 512           // Pagemap entries read at a time
+#define GC_VDB_REMEMBERED_MIN (16*1024*1024) // Old space it takes for dirty bits to pay in minor collections
+#define GC_INITIAL_PAGES 64
+#define GC_ARENA_SIZE (4*1024*1024) // Address space mapped for pages at a time
+#define GC_SPARE_PAGES 16           // Empty pages kept resident after a sweep
+#define GC_NURSERY_SIZE (512*1024)  // Young bytes allocated between minor collections
+#define GC_TLAB_BYTES (32*1024)     // Lock-free allocation between updates of the totals
+#define GC_MAX_MARK_THREADS 64
+#define GC_MARK_DEQUE_SIZE 8192     // Ranges each parallel marker can share
+#define GC_PARALLEL_MARK_MIN (4*1024*1024) // Smaller heaps are marked serially
+#define GC_SWEEP_SLICE_US 200       // Background sweep time per hold of the lock
+#define GC_SWEEP_BATCH 4096         // Dead blocks the sweeper frees outside the lock
+#define GC_REGION_CHUNK (256*1024)  // Region memory mapped at a time
+#define GC_REGION_SPARE_CHUNKS 8    // Chunks kept mapped for the next region
+#define GC_REGION_POISON 0x5a       // Fills released region chunks in debug_stress mode
+#define GC_PROFILE_INITIAL 1024     // Initial heap profile object hash size
+#define GC_PROFILE_SAMPLE (64*1024) // Mean bytes between heap profile samples
+#define GC_IDLE_DIVISOR 2           // gc_idle collects at 1/this of the way to a trigger
+#define GC_COMPACT_SPARSE 4         // Pages with at most 1/this of their slots live get compacted
+#define GC_COMPACT_MIN_PAGES 8      // Sparse pages it takes to make compaction worth it
 
 
+// ---- Scan filter -----------------------------------------------------------
+
+// Conservative scans throw most words away before any lookup. A block of
+// words is compared against the heap bounds at once with SIMD (AVX2 when
+// the CPU has it, SSE2 otherwise on x86-64, plain C elsewhere), and words
+// inside the bounds must also hit the scan filter: one bit per 1MB block of
+// address space that holds part of the heap, hashed into a small bitmap.
+// Bits are set as arenas, mappings and malloc'd blocks are added and the
+// filter is rebuilt from the live heap when a full collection starts
+// marking, so stale bits only cost a lookup.
+
+static inline void filter_add(gc_state *gc, const void *start, size_t len) {
+    uintptr_t first = (uintptr_t)start >> GC_FILTER_SHIFT;
+    uintptr_t last = ((uintptr_t)start + (len ? len - 1 : 0)) >> GC_FILTER_SHIFT;
+    for (uintptr_t b = first; b <= last; b++) {
+        size_t i = b & (GC_FILTER_BITS - 1);
+        gc->scan_filter[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+}
+
+static inline bool filter_hit(const gc_state *gc, const void *ptr) {
+    size_t i = ((uintptr_t)ptr >> GC_FILTER_SHIFT) & (GC_FILTER_BITS - 1);
+    return (gc->scan_filter[i / 64] >> (i % 64)) & 1;
+}
+
+static inline bool in_heap(const gc_state *gc, const void *ptr) {
+    return (uintptr_t)ptr - (uintptr_t)gc->heap_min < (uintptr_t)gc->heap_max - (uintptr_t)gc->heap_min;
+}
+
+// A filter moves words of [*pos, end) that may point into the heap to
+// cands, stopping at the end or once the batch is close to full (it always
+// makes progress). *pos is left where it stopped.
+typedef size_t (*gc_filter_fn)(const gc_state *gc, void ***pos, void **end, void **cands);
+
+// One word at a time, adding to the n candidates found so far
+static inline size_t filter_tail(const gc_state *gc, void ***pos, void **end, void **cands, size_t n) {
+    void **p = *pos;
+    while (p < end && n < GC_SCAN_BATCH) {
+        void *cand = *p++;
+        if (in_heap(gc, cand) && filter_hit(gc, cand)) cands[n++] = cand;
+    }
+    *pos = p;
+    return n;
+}
+
+static size_t filter_scalar(const gc_state *gc, void ***pos, void **end, void **cands) {
+    return filter_tail(gc, pos, end, cands, 0);
+}
+
+#if defined(__x86_64__)
+
+// Candidates among a block's in-bounds words, mask has a bit per word
+static inline size_t filter_block(const gc_state *gc, void **p, unsigned mask, void **cands, size_t n) {
+    while (mask) {
+        void *cand = p[__builtin_ctz(mask)];
+        mask &= mask - 1;
+        if (filter_hit(gc, cand)) cands[n++] = cand;
+    }
+    return n;
+}
+
+// Signed 64-bit a > b per lane, SSE2 only has 32-bit compares
+static inline __m128i cmpgt_epi64_sse2(__m128i a, __m128i b) {
+    __m128i low_sign = _mm_set1_epi64x(0x80000000);
+    __m128i hi_gt = _mm_cmpgt_epi32(a, b);
+    __m128i hi_eq = _mm_cmpeq_epi32(a, b);
+    __m128i lo_gt = _mm_cmpgt_epi32(_mm_xor_si128(a, low_sign), _mm_xor_si128(b, low_sign));
+    lo_gt = _mm_shuffle_epi32(lo_gt, _MM_SHUFFLE(2, 2, 0, 0));
+    __m128i gt = _mm_or_si128(hi_gt, _mm_and_si128(hi_eq, lo_gt));
+    return _mm_shuffle_epi32(gt, _MM_SHUFFLE(3, 3, 1, 1));
+}
+
+// Words are in bounds when word - heap_min < span unsigned, compared as
+// signed with the sign bits flipped
+static size_t filter_sse2(const gc_state *gc, void ***pos, void **end, void **cands) {
+    const __m128i sign = _mm_set1_epi64x(INT64_MIN);
+    const __m128i lo = _mm_set1_epi64x((int64_t)(uintptr_t)gc->heap_min);
+    const __m128i span = _mm_xor_si128(_mm_set1_epi64x((int64_t)((uintptr_t)gc->heap_max - (uintptr_t)gc->heap_min)), sign);
+    void **p = *pos;
+    size_t n = 0;
+    while (end - p >= 4 && n <= GC_SCAN_BATCH - 4) {
+        __m128i a = _mm_xor_si128(_mm_sub_epi64(_mm_loadu_si128((const __m128i*)p), lo), sign);
+        __m128i b = _mm_xor_si128(_mm_sub_epi64(_mm_loadu_si128((const __m128i*)(p + 2)), lo), sign);
+        unsigned mask = (unsigned)_mm_movemask_pd(_mm_castsi128_pd(cmpgt_epi64_sse2(span, a))) |
+                        (unsigned)_mm_movemask_pd(_mm_castsi128_pd(cmpgt_epi64_sse2(span, b))) << 2;
+        if (mask) n = filter_block(gc, p, mask, cands, n);
+        p += 4;
+    }
+    *pos = p;
+    return end - p < 4 ? filter_tail(gc, pos, end, cands, n) : n;
+}
+
+__attribute__((target("avx2")))
+static size_t filter_avx2(const gc_state *gc, void ***pos, void **end, void **cands) {
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i lo = _mm256_set1_epi64x((int64_t)(uintptr_t)gc->heap_min);
+    const __m256i span = _mm256_xor_si256(_mm256_set1_epi64x((int64_t)((uintptr_t)gc->heap_max - (uintptr_t)gc->heap_min)), sign);
+    void **p = *pos;
+    size_t n = 0;
+    while (end - p >= 8 && n <= GC_SCAN_BATCH - 8) {
+        __m256i a = _mm256_xor_si256(_mm256_sub_epi64(_mm256_loadu_si256((const __m256i*)p), lo), sign);
+        __m256i b = _mm256_xor_si256(_mm256_sub_epi64(_mm256_loadu_si256((const __m256i*)(p + 4)), lo), sign);
+        unsigned mask = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(span, a))) |
+                        (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(span, b))) << 4;
+        if (mask) n = filter_block(gc, p, mask, cands, n);
+        p += 8;
+    }
+    *pos = p;
+    return end - p < 8 ? filter_tail(gc, pos, end, cands, n) : n;
+}
+
+#endif
+
+static gc_filter_fn filter_words = filter_scalar;
+
+static void pick_filter(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    filter_words = __builtin_cpu_supports("avx2") ? filter_avx2 : filter_sse2;
+#endif
+}
+
 // ---- Array-based allocation tracking ---------------------------------------
 
 // Mark bit manipulation helpers
 #define MARK_BIT 1
-#define PTR_MASK (~(uintptr_t)1)
+#define ATOMIC_BIT 2
+#define PTR_MASK (~(uintptr_t)3)
 
 static inline void* entry_ptr(const gc_entry *e) {
     return (void*)(e->ptr_and_mark & PTR_MASK);
@@ -29,16 +196,20 @@ static inline int entry_marked(const gc_entry *e) {
     return e->ptr_and_mark & MARK_BIT;
 }
 
+static inline int entry_atomic(const gc_entry *e) {
+    return (e->ptr_and_mark & ATOMIC_BIT) != 0;
+}
+
 static inline void entry_set_marked(gc_entry *e, int marked) {
     if (marked) {
         e->ptr_and_mark |= MARK_BIT;
     } else {
-        e->ptr_and_mark &= PTR_MASK;
+        e->ptr_and_mark &= ~(uintptr_t)MARK_BIT;
     }
 }
 
 static inline void entry_set_ptr(gc_entry *e, void *ptr) {
-    e->ptr_and_mark = ((uintptr_t)ptr & PTR_MASK) | (e->ptr_and_mark & MARK_BIT);
+    e->ptr_and_mark = ((uintptr_t)ptr & PTR_MASK) | (e->ptr_and_mark & ~PTR_MASK);
 }
 
 // Compute direct mapped cache index for a pointer
@@ -65,17 +236,6 @@ static size_t next_power_of_2(size_t n) {
     return power;
 }
 
-// Comparison function for sorting gc_entry by pointer
-static int entry_compare(const void *a, const void *b) {
-    const gc_entry *ea = (const gc_entry *)a;
-    const gc_entry *eb = (const gc_entry *)b;
-    void *pa = entry_ptr(ea);
-    void *pb = entry_ptr(eb);
-    if (pa < pb) return -1;
-    if (pa > pb) return 1;
-    return 0;
-}
-
 // Comparison function for bsearch - finds the allocation containing ptr
 static int find_entry_compare(const void *key, const void *entry) {
     void *search_ptr = *(void * const *)key;
@@ -94,13 +254,14 @@ static int find_entry_compare(const void *key, const void *entry) {
 }
 
 // Binary search to find entry by pointer (supports interior pointers)
-static gc_entry* find_entry(gc_state *gc, void *ptr) {
-    if (gc->alloc_count == 0) return NULL;
+// Only the cycle's sorted prefix of the table is searched. Entries added
+// since the cycle started are already marked and never need to be found.
+// Cache hits and misses are counted in the caller's counters.
+static gc_entry* find_entry(gc_state *gc, void *ptr, size_t *hits, size_t *misses) {
+    if (gc->cycle.count == 0) return NULL;
     
     // Fast path: check if pointer is within the range of all allocations
-    void *min_ptr = entry_ptr(&gc->allocs[0]);
-    void *max_ptr = (char*)entry_ptr(&gc->allocs[gc->alloc_count - 1]) + gc->allocs[gc->alloc_count - 1].size;
-    if (ptr < min_ptr || ptr >= max_ptr) {
+    if (ptr < gc->heap_min || ptr >= gc->heap_max) {
         return NULL;  // Pointer is outside heap range
     }
 
@@ -108,14 +269,36 @@ static gc_entry* find_entry(gc_state *gc, void *ptr) {
     size_t index = dm_cache_idx(gc, ptr);
     gc_entry *cached = gc->cache[index];
     if (cached && entry_ptr(cached) == ptr) {
+        (*hits)++;
         return cached;
     }
+    (*misses)++;
     
     // Finally, bsearch that takes into account interior pointers.
-    return (gc_entry*)bsearch(&ptr, gc->allocs, gc->alloc_count, 
+    return (gc_entry*)bsearch(&ptr, gc->allocs, gc->cycle.count, 
                               sizeof(gc_entry), find_entry_compare);
 }
 
+// Record where an entry of the sorted table now lives
+static inline void cache_entry(gc_state *gc, gc_entry *e) {
+    gc->cache[dm_cache_idx(gc, entry_ptr(e))] = e;
+}
+
+// Forget an entry that is about to be freed
+static inline void uncache_entry(gc_state *gc, gc_entry *e) {
+    size_t index = dm_cache_idx(gc, entry_ptr(e));
+    if (gc->cache[index] == e) gc->cache[index] = NULL;
+}
+
+// The cache points into the array and is kept up to date between cycles,
+// move it along when the array is reallocated
+static void rebase_cache(gc_state *gc, gc_entry *new_allocs) {
+    if (new_allocs == gc->allocs) return;
+    for (size_t i = 0; i < gc->cache_size; i++) {
+        if (gc->cache[i]) gc->cache[i] = new_allocs + (gc->cache[i] - gc->allocs);
+    }
+}
+
 // Grow the allocations array when needed
 static void grow_alloc_array(gc_state *gc) {
     size_t new_capacity = gc->alloc_capacity * 2;
@@ -124,261 +307,3367 @@ static void grow_alloc_array(gc_state *gc) {
         fprintf(stderr, "grow_alloc_array: OOM\n");
         exit(1);
     }
+    rebase_cache(gc, new_allocs);
     gc->allocs = new_allocs;
     gc->alloc_capacity = new_capacity;
 }
 
 // Add a new allocation entry (unsorted append)
-static void add_entry(gc_state *gc, void *ptr, size_t size) {
+static void add_entry(gc_state *gc, void *ptr, size_t size, bool atomic) {
     if (gc->alloc_count >= gc->alloc_capacity) {
         grow_alloc_array(gc);
     }
-    gc->allocs[gc->alloc_count].ptr_and_mark = (uintptr_t)ptr; // unmarked by default
+    // Unmarked by default. Allocations made while a cycle is setting up or
+    // marking start out marked, they are live by definition.
+    bool black = gc->cycle.phase == GC_PHASE_SETUP || gc->cycle.phase == GC_PHASE_MARK;
+    gc->allocs[gc->alloc_count].ptr_and_mark = (uintptr_t)ptr | (atomic ? ATOMIC_BIT : 0) | (black ? MARK_BIT : 0);
     gc->allocs[gc->alloc_count].size = size;
     gc->allocated_bytes += size;
     gc->alloc_count++;
+    filter_add(gc, ptr, size);
 }
 
-// ---- Mark helpers ----------------------------------------------------------
+// ---- Size-class pages ------------------------------------------------------
 
-static bool mark_from_ptr(gc_state *gc, void *ptr);
+// Small objects live in GC_PAGE_SIZE pages carved out of mmap'd arenas, one
+// size class per page. A two-level page map turns any address into its page
+// in constant time, and since every slot of a page has the same size, the
+// object containing an interior pointer is found with a multiply. The page
+// header holds the bitmaps and slots start right after it.
 
-static void scan_range_for_ptrs(gc_state *gc, void *start, void *end) {
-    void **p = (void**)start, **q = (void**)end;
-    size_t bytes = (char*)end - (char*)start;
-    gc->bytes_scanned += bytes;
-    while (p < q) {
-        void *cand = *p++;
-        if (cand) mark_from_ptr(gc, cand);
+#define GC_PAGE_FIRST ((sizeof(gc_page) + GC_GRANULE - 1) & ~(size_t)(GC_GRANULE - 1))
+#define GC_PAGE_MAP_BITS 16         // Page number bits resolved by each map level
+#define GC_PAGE_MAP_SIZE ((size_t)1 << GC_PAGE_MAP_BITS)
+
+static inline bool bit_test(const uint64_t *bits, size_t i) {
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void bit_set(uint64_t *bits, size_t i) {
+    bits[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static inline void bit_clear(uint64_t *bits, size_t i) {
+    bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+// First clear bit in [from, limit), or limit if there is none
+static size_t next_clear_bit(const uint64_t *bits, size_t from, size_t limit) {
+    if (from >= limit) return limit;
+    size_t w = from / 64;
+    uint64_t word = ~bits[w] & (~(uint64_t)0 << (from % 64));
+    for (;;) {
+        if (word) {
+            size_t i = w * 64 + __builtin_ctzll(word);
+            return i < limit ? i : limit;
+        }
+        if (++w * 64 >= limit) return limit;
+        word = ~bits[w];
     }
 }
 
-static bool mark_from_ptr(gc_state *gc, void *ptr) {
-    // Array must be sorted for binary search to work
-    // During gc_collect, array is already sorted
-    gc_entry *e = find_entry(gc, ptr);
-    if (!e || entry_marked(e)) return e != NULL;
-    entry_set_marked(e, 1);
-    void *eptr = entry_ptr(e);
-    scan_range_for_ptrs(gc, eptr, (char*)eptr + e->size);
-    return true;
+// Size classes step by 16 bytes up to 128, then by a quarter of the
+// enclosing power of two: 160, 192, 224, 256, 320, ... 3584, 4096
+static inline size_t size_class(size_t size) {
+    if (size <= 128) return size ? (size - 1) / 16 : 0;
+    int lg = 63 - __builtin_clzll(size - 1);
+    return 8 + (size_t)(lg - 7) * 4 + ((size - 1) >> (lg - 2)) - 4;
 }
 
-// ---- Stack scanning --------------------------------------------------------
+static inline size_t class_size(size_t cls) {
+    if (cls < 8) return (cls + 1) * 16;
+    return ((cls - 8) % 4 + 5) << ((cls - 8) / 4 + 5);
+}
 
-static void scan_stack(gc_state *gc) {
-    void *top;
-    GC_GET_STACK_POINTER(&top);
-    void *bot = gc->stack_bottom;
-    if (top > bot) { void *t = top; top = bot; bot = t; }
-    scan_range_for_ptrs(gc, top, bot);
+static inline size_t page_words(const gc_page *p) {
+    return (p->slots + 63) / 64;
 }
 
-// ---- Public API ------------------------------------------------------------
+static inline char* slot_ptr(gc_page *p, size_t slot) {
+    return (char*)p + GC_PAGE_FIRST + slot * p->size;
+}
 
-void gc_init(gc_state *gc, void *stack_bottom) {
-    gc->alloc_capacity = GC_INITIAL_ALLOC_SIZE;
-    gc->allocs = (gc_entry*)malloc(gc->alloc_capacity * sizeof(gc_entry));
-    if (!gc->allocs) { fprintf(stderr, "gc_init: OOM\n"); exit(1); }
-    gc->alloc_count = 0;
-    gc->allocated_bytes = 0;
-    gc->threshold = DEFAULT_GC_THRESHOLD;
-    gc->stack_bottom = stack_bottom;
+// Slot containing ptr, or SIZE_MAX when it doesn't point into a live object
+static inline size_t page_find_slot(gc_page *p, void *ptr) {
+    size_t off = (size_t)((char*)ptr - (char*)p);
+    if (off < GC_PAGE_FIRST) return SIZE_MAX;
+    if (p->size_class == GC_LARGE_CLASS)
+        return off - GC_PAGE_FIRST < p->size && p->live ? 0 : SIZE_MAX;
+    // Exact for offsets and sizes below 2^16: (off * ceil(2^32 / size)) >> 32
+    size_t slot = (size_t)(((uint64_t)(off - GC_PAGE_FIRST) * p->size_recip) >> 32);
+    if (slot >= p->slots || !bit_test(p->alloc_bits, slot)) return SIZE_MAX;
+    return slot;
+}
 
-    // Initialize cache with minimal size
-    gc->cache_size = 16;  // Minimum cache size
-    gc->cache_mask = gc->cache_size - 1;
-    gc->cache = (gc_entry**)calloc(gc->cache_size, sizeof(gc_entry*));
-    if (!gc->cache) { fprintf(stderr, "gc_init: OOM (cache)\n"); exit(1); }
+static inline gc_page* find_page(gc_state *gc, void *ptr) {
+    if (ptr < gc->page_min || ptr >= gc->page_max) return NULL;
+    uintptr_t n = (uintptr_t)ptr >> GC_PAGE_SHIFT;
+    gc_page **leaf = gc->page_map[n >> GC_PAGE_MAP_BITS];
+    return leaf ? leaf[n & (GC_PAGE_MAP_SIZE - 1)] : NULL;
+}
 
-    gc->root_capacity = GC_INITIAL_ROOTS;
-    gc->roots = (gc_root*)malloc(gc->root_capacity * sizeof(gc_root));
-    if (!gc->roots) { fprintf(stderr, "gc_init: OOM (roots)\n"); exit(1); }
-    gc->root_count = 0;
-    
-    gc->debug_stress = 0;  // Default: stress testing disabled
-    gc->debug_print_stats = 0;  // Default: stats printing disabled
+static void page_map_set(gc_state *gc, gc_page *p, gc_page *value) {
+    uintptr_t n = (uintptr_t)p >> GC_PAGE_SHIFT;
+    gc_page ***slot = &gc->page_map[n >> GC_PAGE_MAP_BITS];
+    if (!*slot) {
+        *slot = (gc_page**)calloc(GC_PAGE_MAP_SIZE, sizeof(gc_page*));
+        if (!*slot) { fprintf(stderr, "page_map_set: OOM\n"); exit(1); }
+    }
+    (*slot)[n & (GC_PAGE_MAP_SIZE - 1)] = value;
 }
 
-void gc_cleanup(gc_state *gc) {
-    for (size_t i = 0; i < gc->alloc_count; i++)
-        free(entry_ptr(&gc->allocs[i]));
-    free(gc->allocs); gc->allocs = NULL; gc->alloc_capacity = 0;
-    gc->alloc_count = 0; gc->allocated_bytes = 0;
-    free(gc->cache); gc->cache = NULL;
-    free(gc->roots); gc->roots = NULL; gc->root_count = 0; gc->root_capacity = 0;
+// Map len bytes of fresh zeroed memory aligned to the page size, returns
+// NULL when the kernel refuses
+static char* map_aligned(size_t len) {
+    size_t total = len + GC_PAGE_SIZE;
+    char *raw = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    char *base = (char*)(((uintptr_t)raw + GC_PAGE_SIZE - 1) & ~(uintptr_t)(GC_PAGE_SIZE - 1));
+    if (base > raw) munmap(raw, base - raw);
+    if (base + len < raw + total) munmap(base + len, raw + total - (base + len));
+    if (((uintptr_t)(base + len - 1) >> GC_PAGE_SHIFT) >> GC_PAGE_MAP_BITS >= GC_PAGE_MAP_SIZE) {
+        fprintf(stderr, "map_aligned: address beyond the page map\n");
+        exit(1);
+    }
+    return base;
 }
 
-// Helper to get time in microseconds
-static double get_time_us(void) {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+static void widen_page_bounds(gc_state *gc, char *start, char *end) {
+    if (!gc->page_min || (void*)start < gc->page_min) gc->page_min = start;
+    if (!gc->page_max || (void*)end > gc->page_max) gc->page_max = end;
 }
 
-void gc_collect(gc_state *gc) {
-    // Record stats before collection
-    size_t old_count = gc->alloc_count;
-    size_t old_bytes = gc->allocated_bytes;
-    double start_time = 0;
-    
-    if (gc->debug_print_stats) {
-        start_time = get_time_us();
+// Track a page in use and point the page map at it for the len bytes it covers
+static void add_page(gc_state *gc, gc_page *p, size_t len) {
+    if (gc->page_count >= gc->page_capacity) {
+        size_t n = gc->page_capacity * 2;
+        gc_page **np = (gc_page**)realloc(gc->pages, n * sizeof(gc_page*));
+        if (!np) { fprintf(stderr, "add_page: OOM (pages)\n"); exit(1); }
+        gc->pages = np; gc->page_capacity = n;
     }
+    gc->pages[gc->page_count++] = p;
+    for (size_t off = 0; off < len; off += GC_PAGE_SIZE)
+        page_map_set(gc, (gc_page*)((char*)p + off), p);
+}
+
+// Map a new arena for pages
+static void add_arena(gc_state *gc) {
+    char *base = map_aligned(GC_ARENA_SIZE);
+    if (!base) { fprintf(stderr, "add_arena: OOM\n"); exit(1); }
     
-    // Reset scan counter
-    gc->bytes_scanned = 0;
-    
-    // Phase 1: Setup (sort allocations and rebuild cache)
-    double setup_start = gc->debug_print_stats ? get_time_us() : 0;
-    
-    // Sort allocations for binary search
-    qsort(gc->allocs, gc->alloc_count, sizeof(gc_entry), entry_compare);
-    
-    // Calculate desired cache size (minimum 16)
-    size_t desired_size = gc->alloc_count > 16 ? next_power_of_2(gc->alloc_count) : 16;
-    
-    // Reallocate cache if needed (too small or more than 4x too large)
-    if (gc->cache_size < desired_size || gc->cache_size > desired_size * 4) {
-        gc_entry **new_cache = (gc_entry**)realloc(gc->cache, desired_size * sizeof(gc_entry*));
-        if (!new_cache) { fprintf(stderr, "gc_collect: OOM (cache)\n"); exit(1); }
-        gc->cache = new_cache;
-        gc->cache_size = desired_size;
-        gc->cache_mask = desired_size - 1;
+    if (gc->arena_count >= gc->arena_capacity) {
+        size_t n = gc->arena_capacity ? gc->arena_capacity * 2 : 8;
+        void **na = (void**)realloc(gc->arenas, n * sizeof(void*));
+        if (!na) { fprintf(stderr, "add_arena: OOM (arenas)\n"); exit(1); }
+        gc->arenas = na; gc->arena_capacity = n;
     }
-    
-    // Clear and populate the direct mapped cache
-    memset(gc->cache, 0, gc->cache_size * sizeof(gc_entry*));
-    for (size_t i = 0; i < gc->alloc_count; i++) {
-        void *ptr = entry_ptr(&gc->allocs[i]);
-        size_t index = dm_cache_idx(gc, ptr);
-        gc->cache[index] = &gc->allocs[i];
+    gc->arenas[gc->arena_count++] = base;
+    gc->arena_next = base;
+    gc->arena_end = base + GC_ARENA_SIZE;
+    widen_page_bounds(gc, base, gc->arena_end);
+    filter_add(gc, base, GC_ARENA_SIZE);
+}
+
+// Set up an empty page for a size class and add it to the page map
+static void init_page(gc_state *gc, gc_page *p, size_t cls) {
+    memset(p, 0, sizeof(gc_page));
+    p->size_class = (uint32_t)cls;
+    p->size = class_size(cls);
+    p->size_recip = (uint32_t)((((uint64_t)1 << 32) + p->size - 1) / p->size);
+    p->slots = (uint32_t)((GC_PAGE_SIZE - GC_PAGE_FIRST) / p->size);
+    add_page(gc, p, GC_PAGE_SIZE);
+}
+
+static gc_page* new_page(gc_state *gc, size_t cls) {
+    gc_page *p = gc->free_pages;
+    if (p) {
+        gc->free_pages = p->next;
+        gc->free_page_count--;
+    } else {
+        if (gc->arena_next >= gc->arena_end) add_arena(gc);
+        p = (gc_page*)gc->arena_next;
+        gc->arena_next += GC_PAGE_SIZE;
+    }
+    init_page(gc, p, cls);
+    return p;
+}
+
+// Move a thread's allocation cursor for a size class to a page with a free
+// slot that no other thread allocates from, adding a page when there is none
+static gc_page* page_refill(gc_state *gc, gc_thread *t, size_t cls) {
+    gc_page *prev = t->alloc_page[cls], *p;
+    if (prev) {
+        prev->exhausted = true;
+        prev->owner = NULL;
+        p = prev->next;
+    } else {
+        p = gc->class_pages[cls];
+    }
+    for (; p; prev = p, p = p->next) {
+        if (p->owner) continue;     // Another thread's allocation buffer
+        if (!p->exhausted && next_clear_bit(p->alloc_bits, 0, p->slots) < p->slots) break;
+        // Nothing left here until a sweep frees something
+        p->exhausted = true;
+    }
+    if (!p) {
+        // Link at the tail so the exhausted pages aren't walked again
+        p = new_page(gc, cls);
+        if (prev) prev->next = p;
+        else gc->class_pages[cls] = p;
+    }
+    p->owner = t;
+    t->alloc_page[cls] = p;
+    t->alloc_slot[cls] = 0;
+    return p;
+}
+
+// Stamp a typed object's hidden header, returns the address the program gets
+static inline char* typed_start(char *ptr, const gc_layout *layout) {
+    *(const gc_layout**)ptr = layout;
+    return ptr + GC_TYPED_HEADER;
+}
+
+// Address the program got for a page object
+static inline char* page_object_start(gc_page *p, size_t slot) {
+    char *start = slot_ptr(p, slot);
+    return bit_test(p->typed_bits, slot) ? start + GC_TYPED_HEADER : start;
+}
+
+// size includes the typed header when there is a layout
+static void* page_alloc(gc_state *gc, gc_thread *t, size_t size, bool atomic, const gc_layout *layout) {
+    size_t cls = size_class(size);
+    gc_page *p = t->alloc_page[cls];
+    size_t slot = p ? next_clear_bit(p->alloc_bits, t->alloc_slot[cls], p->slots) : SIZE_MAX;
+    if (!p || slot >= p->slots) {
+        p = page_refill(gc, t, cls);
+        slot = next_clear_bit(p->alloc_bits, 0, p->slots);
     }
+    t->alloc_slot[cls] = slot + 1;
     
-    double setup_time = gc->debug_print_stats ? get_time_us() - setup_start : 0;
+    bit_set(p->alloc_bits, slot);
+    if (atomic) bit_set(p->atomic_bits, slot);
+    // Young (unmarked) by default. Allocations made while a full cycle is
+    // marking or sweeping start out marked, they are live by definition.
+    if (gc->cycle.phase == GC_PHASE_MARK || gc->cycle.phase == GC_PHASE_SWEEP) {
+        bit_set(p->mark_bits, slot);
+    } else {
+        gc->young_bytes += p->size;
+    }
+    p->live++;
+    gc->allocated_bytes += p->size;
+    gc->page_object_count++;
     
-    // clear marks
-    for (size_t i = 0; i < gc->alloc_count; i++)
-        entry_set_marked(&gc->allocs[i], 0);
+    // Freed slots hold stale data, atomic memory is never scanned so it can stay
+    char *ptr = slot_ptr(p, slot);
+    if (!atomic) memset(ptr, 0, p->size);
+    if (layout) {
+        bit_set(p->typed_bits, slot);
+        ptr = typed_start(ptr, layout);
+    }
+    return ptr;
+}
 
-    // Phase 2: Mark reachable objects
-    double mark_start = gc->debug_print_stats ? get_time_us() : 0;
-    
-    // Save registers using setjmp and scan them
-    jmp_buf regs;
-    setjmp(regs);
+// Allocation from the calling thread's own page without the lock, NULL when
+// the page is full. Only used while no cycle is running, so the object is
+// young. The totals are brought up to date by flush_thread.
+static void* tlab_alloc(gc_thread *t, size_t size, bool atomic, const gc_layout *layout) {
+    size_t cls = size_class(size);
+    gc_page *p = t->alloc_page[cls];
+    if (!p) return NULL;
+    size_t slot = next_clear_bit(p->alloc_bits, t->alloc_slot[cls], p->slots);
+    if (slot >= p->slots) return NULL;
+    t->alloc_slot[cls] = slot + 1;
     
-    // Scan the jmp_buf for pointers
-    // jmp_buf is an array type, so we scan it as a memory region
-    scan_range_for_ptrs(gc, &regs, (char*)&regs + sizeof(regs));
+    bit_set(p->alloc_bits, slot);
+    if (atomic) bit_set(p->atomic_bits, slot);
+    p->live++;
+    t->pending_bytes += p->size;
+    t->pending_objects++;
     
-    // mark: stack + roots (and contents)
-    scan_stack(gc);
-    for (size_t i = 0; i < gc->root_count; i++) {
-        gc_root *r = &gc->roots[i];
-        // Mark the pointer in case the root is a gc heap object.
-        mark_from_ptr(gc, r->ptr);
-        // Scan the range manually for the case it is not a gc heap object.
-        scan_range_for_ptrs(gc, r->ptr, (char*)r->ptr + r->size);
+    char *ptr = slot_ptr(p, slot);
+    if (!atomic) memset(ptr, 0, p->size);
+    if (layout) {
+        bit_set(p->typed_bits, slot);
+        ptr = typed_start(ptr, layout);
     }
-    
-    double mark_time = gc->debug_print_stats ? get_time_us() - mark_start : 0;
+    return ptr;
+}
+
+// Add a thread's lock-free allocations to the totals
+static void flush_thread(gc_state *gc, gc_thread *t) {
+    gc->allocated_bytes += t->pending_bytes;
+    gc->young_bytes += t->pending_bytes;
+    gc->page_object_count += t->pending_objects;
+    t->pending_bytes = 0;
+    t->pending_objects = 0;
+}
 
+// Hand a thread's pages back, its allocation restarts from the head of
+// each class
+static void release_tlab(gc_thread *t) {
+    for (size_t cls = 0; cls < GC_SIZE_CLASSES; cls++) {
+        if (t->alloc_page[cls]) t->alloc_page[cls]->owner = NULL;
+        t->alloc_page[cls] = NULL;
+        t->alloc_slot[cls] = 0;
+    }
+}
+
+// ---- Large objects --------------------------------------------------------
+
+// Allocations of GC_LARGE_MIN bytes and up get a mapping of their own. It
+// starts with a page header describing a single slot, and every page-sized
+// piece of it points back to that header in the page map, so marking,
+// sweeping and promotion treat it like any other page. The memory comes
+// zeroed from the kernel and goes straight back to it when the object dies.
+
+static size_t large_mapping_size(size_t size) {
+    size_t os_page = (size_t)sysconf(_SC_PAGESIZE);
+    return (GC_PAGE_FIRST + size + os_page - 1) & ~(os_page - 1);
+}
+
+static void collect_locked(gc_state *gc, bool wait);
+
+static void* large_alloc(gc_state *gc, size_t size, bool atomic, const gc_layout *layout) {
+    size_t len = large_mapping_size(size);
+    char *base = map_aligned(len);
+    if (!base) { collect_locked(gc, true); base = map_aligned(len); }
+    if (!base) { fprintf(stderr, "gc_malloc: OOM\n"); exit(1); }
     
-    // Phase 3: Sweep unreachable objects
-    double sweep_start = gc->debug_print_stats ? get_time_us() : 0;
+    gc_page *p = (gc_page*)base;
+    p->size_class = GC_LARGE_CLASS;
+    p->size = size;
+    p->slots = 1;
+    p->live = 1;
+    bit_set(p->alloc_bits, 0);
+    if (atomic) bit_set(p->atomic_bits, 0);
+    // Same aging as small objects (see page_alloc)
+    if (gc->cycle.phase == GC_PHASE_MARK || gc->cycle.phase == GC_PHASE_SWEEP) {
+        bit_set(p->mark_bits, 0);
+    } else {
+        gc->young_bytes += size;
+    }
+    gc->allocated_bytes += size;
+    gc->page_object_count++;
+    add_page(gc, p, len);
+    widen_page_bounds(gc, base, base + len);
+    filter_add(gc, base, len);
+    if (layout) {
+        bit_set(p->typed_bits, 0);
+        return typed_start(base + GC_PAGE_FIRST, layout);
+    }
+    return base + GC_PAGE_FIRST;
+}
+
+// Return a dead large object's mapping
+static void unmap_large(gc_state *gc, gc_page *p) {
+    size_t len = large_mapping_size(p->size);
+    for (size_t off = 0; off < len; off += GC_PAGE_SIZE)
+        page_map_set(gc, (gc_page*)((char*)p + off), NULL);
+    munmap(p, len);
+}
+
+// ---- Page sweeping -------------------------------------------------------
+
+// Free the unmarked objects of a page
+static void sweep_page(gc_state *gc, gc_page *p, size_t *freed_count, size_t *freed_bytes) {
+    size_t dead = 0;
+    for (size_t w = 0; w < page_words(p); w++) {
+        dead += __builtin_popcountll(p->alloc_bits[w] & ~p->mark_bits[w]);
+        p->alloc_bits[w] &= p->mark_bits[w];
+        p->atomic_bits[w] &= p->mark_bits[w];
+        p->typed_bits[w] &= p->mark_bits[w];
+    }
+    p->live -= (uint32_t)dead;
+    p->exhausted = false;
+    gc->page_object_count -= dead;
+    gc->allocated_bytes -= dead * p->size;
+    *freed_count += dead;
+    *freed_bytes += dead * p->size;
+}
+
+// After a sweep: move empty pages to the free list, giving the memory of
+// all but a few spares back to the kernel, and restart every thread's
+// allocation from the head of each class since the sweep opened up free slots
+static void release_empty_pages(gc_state *gc) {
+    for (gc_thread *t = gc->threads; t; t = t->next)
+        release_tlab(t);
     
+    // The header stays resident, it links the free list
+    size_t os_page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t keep = (GC_PAGE_FIRST + os_page - 1) & ~(os_page - 1);
     size_t write_pos = 0;
-    size_t new_bytes = 0;
-    
-    for (size_t read_pos = 0; read_pos < gc->alloc_count; read_pos++) {
-        gc_entry *e = &gc->allocs[read_pos];
-        if (entry_marked(e)) {
-            // Keep marked entry
-            if (write_pos != read_pos) {
-                gc->allocs[write_pos] = *e;
-            }
-            write_pos++;
-            new_bytes += e->size;
+    for (size_t i = 0; i < gc->page_count; i++) {
+        gc_page *p = gc->pages[i];
+        if (p->live == 0 && p->size_class == GC_LARGE_CLASS) {
+            unmap_large(gc, p);
+        } else if (p->live == 0) {
+            page_map_set(gc, p, NULL);
+            if (gc->free_page_count >= GC_SPARE_PAGES && keep < GC_PAGE_SIZE)
+                madvise((char*)p + keep, GC_PAGE_SIZE - keep, MADV_DONTNEED);
+            gc->free_page_count++;
         } else {
-            // Free unmarked entry
-            free(entry_ptr(e));
+            gc->pages[write_pos++] = p;
         }
     }
-
-    // Update counts
-    gc->alloc_count = write_pos;
-    gc->allocated_bytes = new_bytes;
+    gc->page_count = write_pos;
     
-    // Shrink the allocations array if it's more than 4x too large
-    if (gc->alloc_capacity > gc->alloc_count * 4 && gc->alloc_capacity > GC_INITIAL_ALLOC_SIZE) {
-        size_t new_capacity = gc->alloc_count * 2;
-        if (new_capacity < GC_INITIAL_ALLOC_SIZE) {
-            new_capacity = GC_INITIAL_ALLOC_SIZE;
+    for (size_t cls = 0; cls < GC_SIZE_CLASSES; cls++) {
+        gc_page **link = &gc->class_pages[cls];
+        while (*link) {
+            gc_page *p = *link;
+            if (p->live == 0) {
+                *link = p->next;
+                p->next = gc->free_pages;
+                gc->free_pages = p;
+            } else {
+                link = &p->next;
+            }
         }
-        gc_entry *new_allocs = (gc_entry*)realloc(gc->allocs, new_capacity * sizeof(gc_entry));
-        if(!new_allocs) { fprintf(stderr, "gc_collect: OOM (shrink allocs)\n"); exit(1); }
-        gc->allocs = new_allocs;
-        gc->alloc_capacity = new_capacity;
     }
+    gc->young_bytes = 0;
+}
 
-    double sweep_time = gc->debug_print_stats ? get_time_us() - sweep_start : 0;
+// Resident set size from /proc, 0 when it can't be read
+static size_t read_rss(void) {
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    char buf[128];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    unsigned long size, resident;
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2) return 0;
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// After a full collection, over rss_target: give the kernel back the spare
+// pages and region chunks kept resident for reuse, and malloc's free memory
+static void trim_memory(gc_state *gc) {
+    size_t before = read_rss();
+    if (before <= gc->rss_target) return;
+    
+    size_t os_page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t keep = (GC_PAGE_FIRST + os_page - 1) & ~(os_page - 1);
+    if (keep < GC_PAGE_SIZE) {
+        for (gc_page *p = gc->free_pages; p; p = p->next)
+            madvise((char*)p + keep, GC_PAGE_SIZE - keep, MADV_DONTNEED);
+    }
+    while (gc->region_spare) {
+        gc_region_chunk *c = gc->region_spare;
+        gc->region_spare = c->next;
+        munmap(c, GC_REGION_CHUNK);
+    }
+    gc->region_spare_count = 0;
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
     
+    size_t after = read_rss();
+    gc->stats.rss_trims++;
+    gc->stats.rss_before_bytes = before;
+    gc->stats.rss_after_bytes = after;
+    if (after < before) gc->stats.rss_returned_bytes += before - after;
     if (gc->debug_print_stats) {
-        double total_time = get_time_us() - start_time;
-        size_t freed_count = old_count - gc->alloc_count;
-        size_t freed_bytes = old_bytes - gc->allocated_bytes;
-        
-        fprintf(stderr, "GC: %zu->%zu allocs, %zu->%zu bytes (freed %zu/%zu), scanned %zu bytes, %.0fus (setup:%.1f%% mark:%.1f%% sweep:%.1f%%)\n",
-                old_count, gc->alloc_count,
-                old_bytes, gc->allocated_bytes,
-                freed_count, freed_bytes,
-                gc->bytes_scanned,
-                total_time,
-                (setup_time/total_time)*100,
-                (mark_time/total_time)*100,
-                (sweep_time/total_time)*100);
+        fprintf(stderr, "GC trim: RSS %zu->%zu bytes (target %zu)\n", before, after, gc->rss_target);
     }
+}
+
+// ---- Mark helpers ----------------------------------------------------------
+
+// Marking is iterative: reachable objects are pushed on an explicit stack of
+// ranges still to be scanned, so deep or long object chains (cJSON sibling
+// lists, linked structures) cost mark stack slots instead of C stack frames.
+// A typed object is queued whole with GC_RANGE_TYPED set in the start of its
+// range, which then points at its header, and only its pointer words are
+// loaded when the range comes up.
 
-    if (gc->allocated_bytes > (gc->threshold * 3) / 4) gc->threshold *= 2;
+#define GC_RANGE_TYPED 1
+
+static inline bool range_typed(gc_mark_range r) {
+    return (uintptr_t)r.start & GC_RANGE_TYPED;
 }
 
-void* gc_malloc(gc_state *gc, size_t size) {
-    // Debug stress mode: force collection before every allocation
-    if (gc->debug_stress || (gc->allocated_bytes + size > gc->threshold)) {
-        gc_collect(gc);
+// The mark stack grows while other threads are stopped, possibly inside
+// malloc holding its locks, so it is mapped directly
+static gc_mark_range* resize_mark_stack(gc_state *gc, size_t n) {
+    size_t len = n * sizeof(gc_mark_range);
+    void *ns = gc->mark_stack ?
+        mremap(gc->mark_stack, gc->mark_stack_capacity * sizeof(gc_mark_range), len, MREMAP_MAYMOVE) :
+        mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ns == MAP_FAILED) return NULL;
+    gc->mark_stack = (gc_mark_range*)ns;
+    gc->mark_stack_capacity = n;
+    return gc->mark_stack;
+}
+
+static void mark_stack_push(gc_state *gc, void *start, void *end) {
+    if (gc->mark_stack_size >= gc->mark_stack_capacity) {
+        if (!resize_mark_stack(gc, gc->mark_stack_capacity * 2)) {
+            fprintf(stderr, "mark_stack_push: OOM\n");
+            exit(1);
+        }
     }
+    gc->mark_stack[gc->mark_stack_size++] = (gc_mark_range){ .start = start, .end = end };
+}
 
-    void *p = malloc(size);
-    if (!p) { gc_collect(gc); p = malloc(size); }
-    if (!p) { fprintf(stderr, "gc_malloc: OOM\n"); exit(1); }
+// Mark an unmarked entry and queue its contents for scanning
+static void mark_entry(gc_state *gc, gc_entry *e) {
+    entry_set_marked(e, 1);
+    if (entry_atomic(e)) {
+        // Pointer-free allocation, nothing inside can keep other objects alive
+        gc->bytes_skipped += e->size;
+        return;
+    }
+    void *eptr = entry_ptr(e);
+    __builtin_prefetch(eptr);
+    mark_stack_push(gc, eptr, (char*)eptr + e->size);
+}
 
-    memset(p, 0, size);
-    add_entry(gc, p, size);
+// Range covering a pointer-bearing page object, tagged when it is typed
+static inline gc_mark_range page_object_range(gc_state *gc, gc_page *p, size_t slot) {
+    char *start = slot_ptr(p, slot);
+    __builtin_prefetch(start);
+    if (gc->typed_scan && bit_test(p->typed_bits, slot))
+        return (gc_mark_range){ .start = start + GC_RANGE_TYPED, .end = start + p->size };
+    return (gc_mark_range){ .start = start, .end = start + p->size };
+}
+
+// Mark the page object containing ptr and queue its contents. Marked
+// objects are skipped, which is what limits a minor collection to young ones.
+static bool mark_page_object(gc_state *gc, gc_page *p, void *ptr) {
+    size_t slot = page_find_slot(p, ptr);
+    if (slot == SIZE_MAX) return false;
+    if (bit_test(p->mark_bits, slot)) return true;
+    bit_set(p->mark_bits, slot);
     
-    // Note: Array becomes unsorted after add, but that's OK.
-    // It will be sorted at next gc_collect() before any lookups.
-    return p;
+    if (bit_test(p->atomic_bits, slot)) {
+        gc->bytes_skipped += p->size;
+        return true;
+    }
+    gc_mark_range r = page_object_range(gc, p, slot);
+    mark_stack_push(gc, r.start, r.end);
+    return true;
+}
+
+static bool mark_from_ptr(gc_state *gc, void *ptr) {
+    gc_page *p = find_page(gc, ptr);
+    if (p) return mark_page_object(gc, p, ptr);
+    
+    // Array must be sorted for binary search to work
+    // During gc_collect, array is already sorted
+    gc_entry *e = find_entry(gc, ptr, &gc->stats.cache_hits, &gc->stats.cache_misses);
+    if (!e) return false;
+    if (!entry_marked(e)) mark_entry(gc, e);
+    return true;
 }
 
-size_t gc_allocated_bytes(gc_state *gc) { return gc->allocated_bytes; }
+// Look up a batch of candidate pointers. The direct mapped cache slots for
+// the whole batch are prefetched before any of them is probed.
+static void mark_candidates(gc_state *gc, void **cands, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        __builtin_prefetch(&gc->cache[dm_cache_idx(gc, cands[i])]);
+    for (size_t i = 0; i < n; i++)
+        mark_from_ptr(gc, cands[i]);
+}
 
-void gc_add_root(gc_state *gc, void *ptr, size_t size) {
-    if (gc->root_count >= gc->root_capacity) {
-        size_t n = gc->root_capacity * 2;
-        gc_root *nr = (gc_root*)realloc(gc->roots, n * sizeof(gc_root));
-        if (!nr) { fprintf(stderr, "gc_add_root: OOM\n"); return; }
-        gc->roots = nr; gc->root_capacity = n;
+static void scan_range_for_ptrs(gc_state *gc, void *start, void *end) {
+    void **p = (void**)start, **q = (void**)end;
+    size_t bytes = (char*)end - (char*)start;
+    gc->bytes_scanned += bytes;
+    void *cands[GC_SCAN_BATCH];
+    // Only words that pass the filter are worth a lookup
+    while (p < q) {
+        size_t n = filter_words(gc, &p, q, cands);
+        if (n) mark_candidates(gc, cands, n);
     }
-    gc->roots[gc->root_count++] = (gc_root){ .ptr = ptr, .size = size };
 }
 
-void gc_remove_root(gc_state *gc, void *ptr) {
-    for (size_t i = 0; i < gc->root_count; i++) {
-        if (gc->roots[i].ptr == ptr) {
-            gc->roots[i] = gc->roots[gc->root_count - 1];
-            gc->root_count--;
-            return;
+// Conservative scan of a range, given to the root scanners: marking, or
+// pinning for compaction
+typedef void (*scan_fn)(gc_state *gc, void *start, void *end);
+
+static void worker_mark(gc_mark_worker *w, void *ptr);
+
+// Mark what the pointer words of a typed object point to, for the collecting
+// thread or, with w, for a parallel marker. The layout repeats over the
+// whole slot, a trailing partial element is cut to the words that fit.
+static void scan_typed(gc_state *gc, gc_mark_worker *w, gc_mark_range r) {
+    char *header = (char*)((uintptr_t)r.start & ~(uintptr_t)GC_RANGE_TYPED);
+    const gc_layout *layout = *(const gc_layout**)header;
+    char *elem = header + GC_TYPED_HEADER, *end = (char*)r.end;
+    size_t loaded = 0;
+    void *cands[GC_SCAN_BATCH];
+    size_t n = 0;
+    for (; elem < end; elem += layout->size) {
+        uint64_t bits = layout->ptr_words;
+        size_t fit = (size_t)(end - elem) / sizeof(void*);
+        if (fit < 64) bits &= ((uint64_t)1 << fit) - 1;
+        for (; bits; bits &= bits - 1) {
+            void *cand = ((void**)elem)[__builtin_ctzll(bits)];
+            loaded++;
+            if (!in_heap(gc, cand) || !filter_hit(gc, cand)) continue;
+            cands[n++] = cand;
+            if (n < GC_SCAN_BATCH) continue;
+            if (w) {
+                for (size_t i = 0; i < n; i++) worker_mark(w, cands[i]);
+            } else {
+                mark_candidates(gc, cands, n);
+            }
+            n = 0;
+        }
+    }
+    if (w) {
+        for (size_t i = 0; i < n; i++) worker_mark(w, cands[i]);
+    } else if (n) {
+        mark_candidates(gc, cands, n);
+    }
+    
+    size_t scanned = loaded * sizeof(void*), skipped = (size_t)(end - header) - scanned;
+    if (w) {
+        w->bytes_scanned += scanned;
+        w->bytes_typed += skipped;
+    } else {
+        gc->bytes_scanned += scanned;
+        gc->bytes_typed += skipped;
+    }
+}
+
+// Scan queued ranges until the mark stack is empty or max_ranges have been
+// scanned. Popped ranges go through a small FIFO so each one is prefetched a
+// few ranges before it is scanned. Returns true when the stack is empty.
+static bool drain_mark_stack(gc_state *gc, size_t max_ranges) {
+    gc_mark_range fifo[GC_PREFETCH_DISTANCE];
+    size_t head = 0, count = 0, scanned = 0;
+    while (scanned < max_ranges) {
+        if (gc->mark_stack_size > 0 && count < GC_PREFETCH_DISTANCE) {
+            gc_mark_range r = gc->mark_stack[--gc->mark_stack_size];
+            // Split large objects so the stack stays shallow and every
+            // slice gets its own prefetch. Typed ones need their header,
+            // they are scanned whole.
+            if (!range_typed(r) && (size_t)((char*)r.end - (char*)r.start) > GC_MARK_SLICE_BYTES) {
+                mark_stack_push(gc, (char*)r.start + GC_MARK_SLICE_BYTES, r.end);
+                r.end = (char*)r.start + GC_MARK_SLICE_BYTES;
+            }
+            __builtin_prefetch(r.start);
+            fifo[(head + count++) % GC_PREFETCH_DISTANCE] = r;
+            continue;
+        }
+        if (count == 0) break;
+        gc_mark_range r = fifo[head];
+        head = (head + 1) % GC_PREFETCH_DISTANCE;
+        count--;
+        if (range_typed(r)) scan_typed(gc, NULL, r);
+        else scan_range_for_ptrs(gc, r.start, r.end);
+        scanned++;
+    }
+    // Out of budget: hand prefetched ranges back to the stack
+    while (count > 0) {
+        mark_stack_push(gc, fifo[head].start, fifo[head].end);
+        head = (head + 1) % GC_PREFETCH_DISTANCE;
+        count--;
+    }
+    return gc->mark_stack_size == 0;
+}
+
+// ---- Parallel marking ------------------------------------------------------
+
+// The collecting thread deals the queued ranges out to the workers' deques
+// and marks alongside the helpers until no worker has anything left. The
+// heap doesn't change meanwhile (the other program threads are stopped), so
+// lookups need no care, only mark bits are set atomically: whichever worker
+// sets a bit first scans the object. Helpers are plain threads unknown to
+// stop_world, parked on a condition variable between rounds.
+
+static void* map_ranges(gc_mark_range *old, size_t old_n, size_t n) {
+    void *p = old ?
+        mremap(old, old_n * sizeof(gc_mark_range), n * sizeof(gc_mark_range), MREMAP_MAYMOVE) :
+        mmap(NULL, n * sizeof(gc_mark_range), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) { fprintf(stderr, "gc_collect: OOM (mark deque)\n"); exit(1); }
+    return p;
+}
+
+static void worker_push(gc_mark_worker *w, void *start, void *end) {
+    gc_mark_range r = { .start = start, .end = end };
+    int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    if (b - t < GC_MARK_DEQUE_SIZE) {
+        w->deque[b % GC_MARK_DEQUE_SIZE] = r;
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+        return;
+    }
+    if (w->overflow_size >= w->overflow_capacity) {
+        size_t n = w->overflow_capacity ? w->overflow_capacity * 2 : GC_INITIAL_MARK_STACK;
+        w->overflow = map_ranges(w->overflow, w->overflow_capacity, n);
+        w->overflow_capacity = n;
+    }
+    w->overflow[w->overflow_size++] = r;
+}
+
+static bool worker_pop(gc_mark_worker *w, gc_mark_range *r) {
+    int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+    if (t <= b) {
+        *r = w->deque[b % GC_MARK_DEQUE_SIZE];
+        if (t < b) return true;
+        // Last range, race thieves for it
+        bool won = __atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+                                               __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+        if (won) return true;
+    } else {
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    if (w->overflow_size == 0) return false;
+    *r = w->overflow[--w->overflow_size];
+    return true;
+}
+
+static bool worker_steal(gc_mark_worker *w, gc_mark_range *r) {
+    int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return false;
+    *r = w->deque[t % GC_MARK_DEQUE_SIZE];
+    return __atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static bool worker_steal_any(gc_state *gc, size_t self, gc_mark_range *r) {
+    size_t n = gc->mark_helpers + 1;
+    for (size_t k = 1; k < n; k++) {
+        if (worker_steal(&gc->mark_workers[(self + k) % n], r)) return true;
+    }
+    return false;
+}
+
+static bool worker_work_visible(gc_state *gc) {
+    for (size_t i = 0; i <= gc->mark_helpers; i++) {
+        gc_mark_worker *w = &gc->mark_workers[i];
+        if (__atomic_load_n(&w->top, __ATOMIC_RELAXED) < __atomic_load_n(&w->bottom, __ATOMIC_RELAXED))
+            return true;
+    }
+    return false;
+}
+
+// mark_from_ptr with a claim by atomic mark bit
+static void worker_mark(gc_mark_worker *w, void *ptr) {
+    gc_state *gc = w->gc;
+    gc_page *p = find_page(gc, ptr);
+    if (p) {
+        size_t slot = page_find_slot(p, ptr);
+        if (slot == SIZE_MAX) return;
+        uint64_t bit = (uint64_t)1 << (slot % 64);
+        uint64_t *word = &p->mark_bits[slot / 64];
+        if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return;
+        if (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) return;
+        if (bit_test(p->atomic_bits, slot)) {
+            w->bytes_skipped += p->size;
+            return;
+        }
+        gc_mark_range r = page_object_range(gc, p, slot);
+        worker_push(w, r.start, r.end);
+        return;
+    }
+    
+    gc_entry *e = find_entry(gc, ptr, &w->cache_hits, &w->cache_misses);
+    if (!e || entry_marked(e)) return;
+    if (__atomic_fetch_or(&e->ptr_and_mark, MARK_BIT, __ATOMIC_RELAXED) & MARK_BIT) return;
+    if (entry_atomic(e)) {
+        w->bytes_skipped += e->size;
+        return;
+    }
+    void *eptr = entry_ptr(e);
+    __builtin_prefetch(eptr);
+    worker_push(w, eptr, (char*)eptr + e->size);
+}
+
+static void worker_scan(gc_mark_worker *w, gc_mark_range r) {
+    gc_state *gc = w->gc;
+    if (range_typed(r)) {
+        scan_typed(gc, w, r);
+        return;
+    }
+    if ((size_t)((char*)r.end - (char*)r.start) > GC_MARK_SLICE_BYTES) {
+        worker_push(w, (char*)r.start + GC_MARK_SLICE_BYTES, r.end);
+        r.end = (char*)r.start + GC_MARK_SLICE_BYTES;
+    }
+    w->bytes_scanned += (char*)r.end - (char*)r.start;
+    void *cands[GC_SCAN_BATCH];
+    for (void **p = (void**)r.start, **q = (void**)r.end; p < q;) {
+        size_t n = filter_words(gc, &p, q, cands);
+        for (size_t i = 0; i < n; i++)
+            __builtin_prefetch(&gc->cache[dm_cache_idx(gc, cands[i])]);
+        for (size_t i = 0; i < n; i++)
+            worker_mark(w, cands[i]);
+    }
+}
+
+// Mark until every worker is out of work. mark_active counts the workers
+// that may still push ranges; once it drops to zero all deques are empty.
+static void worker_run(gc_state *gc, size_t self) {
+    gc_mark_worker *w = &gc->mark_workers[self];
+    gc_mark_range r;
+    for (;;) {
+        while (worker_pop(w, &r) || worker_steal_any(gc, self, &r))
+            worker_scan(w, r);
+        __atomic_sub_fetch(&gc->mark_active, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&gc->mark_active, __ATOMIC_SEQ_CST) == 0) return;
+            if (worker_work_visible(gc)) {
+                __atomic_add_fetch(&gc->mark_active, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void* mark_helper(void *arg) {
+    gc_mark_worker *w = (gc_mark_worker*)arg;
+    gc_state *gc = w->gc;
+    // Rounds are counted from 0 when the helpers start: one may begin
+    // before this thread first gets the lock
+    unsigned round = 0;
+    pthread_mutex_lock(&gc->mark_lock);
+    for (;;) {
+        while (gc->mark_round == round && !gc->mark_quit)
+            pthread_cond_wait(&gc->mark_wake, &gc->mark_lock);
+        if (gc->mark_quit) break;
+        round = gc->mark_round;
+        pthread_mutex_unlock(&gc->mark_lock);
+        worker_run(gc, (size_t)(w - gc->mark_workers));
+        pthread_mutex_lock(&gc->mark_lock);
+        if (++gc->mark_finished == gc->mark_helpers) pthread_cond_signal(&gc->mark_done);
+    }
+    pthread_mutex_unlock(&gc->mark_lock);
+    return NULL;
+}
+
+// The collector's own threads take no asynchronous signals, those are for
+// the program's threads. Threads created meanwhile inherit the mask.
+static void block_async_signals(sigset_t *old_mask) {
+    sigset_t all;
+    sigfillset(&all);
+    sigdelset(&all, SIGSEGV);
+    sigdelset(&all, SIGBUS);
+    sigdelset(&all, SIGFPE);
+    sigdelset(&all, SIGILL);
+    pthread_sigmask(SIG_SETMASK, &all, old_mask);
+}
+
+// Start the helpers when parallel marking is first wanted. This allocates,
+// so it runs before the other program threads are stopped.
+static void start_mark_helpers(gc_state *gc) {
+    if (gc->mark_workers || gc->mark_threads <= 1) return;
+    unsigned n = gc->mark_threads < GC_MAX_MARK_THREADS ? gc->mark_threads : GC_MAX_MARK_THREADS;
+    gc->mark_workers = (gc_mark_worker*)calloc(n, sizeof(gc_mark_worker));
+    if (!gc->mark_workers) { fprintf(stderr, "gc_collect: OOM (mark workers)\n"); exit(1); }
+    gc->mark_workers[0].gc = gc;
+    gc->mark_workers[0].deque = map_ranges(NULL, 0, GC_MARK_DEQUE_SIZE);
+    gc->mark_round = 0;
+    
+    sigset_t old_mask;
+    block_async_signals(&old_mask);
+    for (unsigned i = 1; i < n; i++) {
+        gc_mark_worker *w = &gc->mark_workers[i];
+        w->gc = gc;
+        w->deque = map_ranges(NULL, 0, GC_MARK_DEQUE_SIZE);
+        if (pthread_create(&w->thread, NULL, mark_helper, w) != 0) {
+            munmap(w->deque, GC_MARK_DEQUE_SIZE * sizeof(gc_mark_range));
+            break;
+        }
+        gc->mark_helpers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+static void stop_mark_helpers(gc_state *gc) {
+    if (!gc->mark_workers) return;
+    pthread_mutex_lock(&gc->mark_lock);
+    gc->mark_quit = true;
+    pthread_cond_broadcast(&gc->mark_wake);
+    pthread_mutex_unlock(&gc->mark_lock);
+    for (unsigned i = 1; i <= gc->mark_helpers; i++)
+        pthread_join(gc->mark_workers[i].thread, NULL);
+    for (unsigned i = 0; i <= gc->mark_helpers; i++) {
+        gc_mark_worker *w = &gc->mark_workers[i];
+        munmap(w->deque, GC_MARK_DEQUE_SIZE * sizeof(gc_mark_range));
+        if (w->overflow) munmap(w->overflow, w->overflow_capacity * sizeof(gc_mark_range));
+    }
+    free(gc->mark_workers);
+    gc->mark_workers = NULL;
+    gc->mark_helpers = 0;
+    gc->mark_quit = false;
+}
+
+// Empty the mark stack, in parallel when there are helpers and the heap is
+// big enough to be worth waking them
+static void mark_all(gc_state *gc) {
+    if (gc->mark_helpers == 0 || gc->allocated_bytes < GC_PARALLEL_MARK_MIN) {
+        drain_mark_stack(gc, SIZE_MAX);
+        return;
+    }
+    size_t n = gc->mark_helpers + 1;
+    for (size_t i = 0; i < gc->mark_stack_size; i++)
+        worker_push(&gc->mark_workers[i % n], gc->mark_stack[i].start, gc->mark_stack[i].end);
+    gc->mark_stack_size = 0;
+    gc->mark_active = (int)n;
+    
+    pthread_mutex_lock(&gc->mark_lock);
+    gc->mark_finished = 0;
+    gc->mark_round++;
+    pthread_cond_broadcast(&gc->mark_wake);
+    pthread_mutex_unlock(&gc->mark_lock);
+    worker_run(gc, 0);
+    pthread_mutex_lock(&gc->mark_lock);
+    while (gc->mark_finished < gc->mark_helpers)
+        pthread_cond_wait(&gc->mark_done, &gc->mark_lock);
+    pthread_mutex_unlock(&gc->mark_lock);
+    
+    for (size_t i = 0; i < n; i++) {
+        gc_mark_worker *w = &gc->mark_workers[i];
+        gc->bytes_scanned += w->bytes_scanned;
+        gc->bytes_skipped += w->bytes_skipped;
+        gc->bytes_typed += w->bytes_typed;
+        gc->stats.cache_hits += w->cache_hits;
+        gc->stats.cache_misses += w->cache_misses;
+        w->bytes_scanned = w->bytes_skipped = w->bytes_typed = 0;
+        w->cache_hits = w->cache_misses = 0;
+    }
+}
+
+// ---- Threads ---------------------------------------------------------------
+
+// Threads are stopped with a signal. The handler saves the registers and
+// stack pointer, acknowledges through suspend_ack and waits in sigsuspend
+// until resume_count moves on, then acknowledges again. A thread inside the
+// lock-free allocation path only notes the request and stops itself once
+// the allocation is complete.
+
+#ifdef SIGPWR
+#define GC_SUSPEND_SIGNAL SIGPWR
+#else
+#define GC_SUSPEND_SIGNAL SIGUSR1
+#endif
+#define GC_RESUME_SIGNAL SIGXCPU
+
+static __thread gc_thread *gc_current_thread;
+
+static void sem_wait_retry(sem_t *sem) {
+    while (sem_wait(sem) != 0 && errno == EINTR) {}
+}
+
+static void suspend_self(gc_thread *t) {
+    gc_state *gc = t->gc;
+    // Resume signals stay pending until sigsuspend, so none is missed
+    sigset_t resume_only, old_mask, wait_mask;
+    sigemptyset(&resume_only);
+    sigaddset(&resume_only, GC_RESUME_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &resume_only, &old_mask);
+    
+    unsigned resume = __atomic_load_n(&gc->resume_count, __ATOMIC_ACQUIRE);
+    setjmp(t->regs);
+    GC_GET_STACK_POINTER(&t->stack_top);
+    sem_post(&gc->suspend_ack);
+    
+    sigfillset(&wait_mask);
+    sigdelset(&wait_mask, GC_RESUME_SIGNAL);
+    while (__atomic_load_n(&gc->resume_count, __ATOMIC_ACQUIRE) == resume)
+        sigsuspend(&wait_mask);
+    
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    sem_post(&gc->suspend_ack);
+}
+
+static void suspend_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    gc_thread *t = gc_current_thread;
+    if (t) {
+        if (t->in_alloc) t->suspend_pending = 1;
+        else suspend_self(t);
+    }
+    errno = saved_errno;
+}
+
+static void resume_handler(int sig) {
+    (void)sig;
+}
+
+// Only needed with other threads to stop, so a single-threaded program
+// keeps its own dispositions. With the lock held.
+static void install_signal_handlers(gc_state *gc) {
+    if (gc->signals_installed) return;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = suspend_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, GC_RESUME_SIGNAL);
+    sa.sa_flags = SA_RESTART;
+    sigaction(GC_SUSPEND_SIGNAL, &sa, &gc->old_suspend_action);
+    
+    sa.sa_handler = resume_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(GC_RESUME_SIGNAL, &sa, &gc->old_resume_action);
+    gc->signals_installed = true;
+}
+
+static void restore_signal_handlers(gc_state *gc) {
+    if (!gc->signals_installed || gc->thread_count > 1) return;
+    sigaction(GC_SUSPEND_SIGNAL, &gc->old_suspend_action, NULL);
+    sigaction(GC_RESUME_SIGNAL, &gc->old_resume_action, NULL);
+    gc->signals_installed = false;
+}
+
+// Calling thread's record, registration is required to use the collector
+static gc_thread* current_thread(gc_state *gc, const char *fn) {
+    gc_thread *t = gc_current_thread;
+    if (!t || t->gc != gc) {
+        fprintf(stderr, "%s: thread not registered\n", fn);
+        exit(1);
+    }
+    return t;
+}
+
+// Stop every other registered thread, with the lock held. Nothing in here or
+// until resume_world may call malloc: a stopped thread could be holding its
+// locks.
+static void stop_world(gc_state *gc) {
+    if (gc->world_stopped++ > 0) return;
+    gc_thread *self = gc_current_thread;
+    size_t stopped = 0;
+    for (gc_thread *t = gc->threads; t; t = t->next) {
+        if (t != self && pthread_kill(t->id, GC_SUSPEND_SIGNAL) == 0) stopped++;
+    }
+    while (stopped-- > 0) sem_wait_retry(&gc->suspend_ack);
+    for (gc_thread *t = gc->threads; t; t = t->next)
+        flush_thread(gc, t);
+}
+
+static void resume_world(gc_state *gc) {
+    if (--gc->world_stopped > 0) return;
+    gc_thread *self = gc_current_thread;
+    __atomic_add_fetch(&gc->resume_count, 1, __ATOMIC_RELEASE);
+    size_t resumed = 0;
+    for (gc_thread *t = gc->threads; t; t = t->next) {
+        if (t != self && pthread_kill(t->id, GC_RESUME_SIGNAL) == 0) resumed++;
+    }
+    while (resumed-- > 0) sem_wait_retry(&gc->suspend_ack);
+}
+
+// ---- Regions ---------------------------------------------------------------
+
+// A region is a pair of chunk lists, one for objects that may hold pointers
+// and one for pointer-free ones. Objects are bump allocated from the first
+// chunk of each list, and those too big for a standard chunk get one of
+// their own. Chunks are not in the page map, so pointers into a region
+// never mark anything: its scan chunks are scanned like roots and all of
+// it goes when the region ends. Chunks are linked and unlinked with the
+// lock held so a collector never sees a list half updated, the bump itself
+// only touches the owning thread's chunk.
+
+#define GC_REGION_FIRST ((sizeof(gc_region_chunk) + GC_GRANULE - 1) & ~(size_t)(GC_GRANULE - 1))
+#define GC_REGION_HEADER GC_GRANULE // Object header, keeps objects aligned
+#define GC_REGION_STANDARD (GC_REGION_CHUNK - GC_REGION_FIRST)
+
+static inline size_t region_footprint(size_t size) {
+    return GC_REGION_HEADER + ((size + GC_GRANULE - 1) & ~(size_t)(GC_GRANULE - 1));
+}
+
+static inline size_t* region_header(const void *ptr) {
+    return (size_t*)((char*)ptr - GC_REGION_HEADER);
+}
+
+// Layout given to a region object, kept for when it escapes
+static inline const gc_layout** region_layout(const void *ptr) {
+    return (const gc_layout**)(region_header(ptr) + 1);
+}
+
+// Chunk with room for total bytes of objects, with the lock held
+static gc_region_chunk* region_chunk_new(gc_state *gc, size_t total) {
+    gc_region_chunk *c = NULL;
+    if (total <= GC_REGION_STANDARD && gc->region_spare) {
+        c = gc->region_spare;
+        gc->region_spare = c->next;
+        gc->region_spare_count--;
+    } else {
+        size_t os_page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t len = GC_REGION_CHUNK;
+        if (total > GC_REGION_STANDARD) len = (GC_REGION_FIRST + total + os_page - 1) & ~(os_page - 1);
+        for (int attempt = 0; attempt < 2 && !c; attempt++) {
+            if (attempt) collect_locked(gc, true);
+            c = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (c == MAP_FAILED) c = NULL;
+        }
+        if (!c) { fprintf(stderr, "gc_malloc: OOM (region)\n"); exit(1); }
+        c->size = len - GC_REGION_FIRST;
+    }
+    c->next = NULL;
+    c->used = 0;
+    return c;
+}
+
+// Return a region's chunks, keeping a few standard ones for reuse. In
+// stress mode what they held is poisoned, so a missed gc_region_escape
+// fails loudly.
+static void region_free_chunks(gc_state *gc, gc_region_chunk *c) {
+    while (c) {
+        gc_region_chunk *next = c->next;
+        gc->region_bytes -= c->size;
+        if (gc->debug_stress) memset((char*)c + GC_REGION_FIRST, GC_REGION_POISON, c->used);
+        if (c->size == GC_REGION_STANDARD && gc->region_spare_count < GC_REGION_SPARE_CHUNKS) {
+            c->next = gc->region_spare;
+            gc->region_spare = c;
+            gc->region_spare_count++;
+        } else {
+            munmap(c, GC_REGION_FIRST + c->size);
+        }
+        c = next;
+    }
+}
+
+static void gc_step(gc_state *gc, double budget_us);
+
+// A region grew by a chunk, with the lock held. Its memory can't be
+// collected, but it counts towards the threshold so the heap around it is,
+// and adjust_threshold grows the threshold past it.
+static void region_grown(gc_state *gc, gc_region_chunk *c) {
+    gc->region_bytes += c->size;
+    if (gc->debug_stress) return;  // Collects on every allocation anyway
+    size_t slack = gc->defer_depth ? 2 : 1;
+    if (gc->cycle.phase != GC_PHASE_IDLE) {
+        if (!gc->defer_depth) gc_step(gc, gc->incremental_step_us);
+    } else if (gc->allocated_bytes - gc->young_bytes + gc->region_bytes > gc->threshold * slack) {
+        if (gc->incremental_step_us) gc_step(gc, gc->incremental_step_us);
+        else collect_locked(gc, false);
+    }
+}
+
+static void* region_alloc(gc_state *gc, gc_region *r, size_t size, bool atomic, const gc_layout *layout) {
+    gc_region_chunk **list = atomic ? &r->atomic : &r->scan;
+    size_t total = region_footprint(size);
+    gc_region_chunk *c = *list;
+    if (!c || c->size - c->used < total) {
+        pthread_mutex_lock(&gc->lock);
+        c = region_chunk_new(gc, total);
+        if (total > GC_REGION_STANDARD && *list) {
+            // An object of its own, bumping goes on in the current chunk
+            c->next = (*list)->next;
+            (*list)->next = c;
+        } else {
+            c->next = *list;
+            *list = c;
+        }
+        region_grown(gc, c);
+        pthread_mutex_unlock(&gc->lock);
+    }
+    char *ptr = (char*)c + GC_REGION_FIRST + c->used + GC_REGION_HEADER;
+    *region_header(ptr) = size;
+    *region_layout(ptr) = layout;
+    // Chunks are reused, only the kernel's memory comes zeroed
+    if (!atomic) memset(ptr, 0, size);
+    c->used += total;
+    r->bytes += total;
+    r->objects++;
+    return ptr;
+}
+
+// Region of the thread holding the object that starts at ptr, along with
+// its chunk and whether it is atomic
+static gc_region* region_find(gc_thread *t, const void *ptr, gc_region_chunk **chunk, bool *atomic) {
+    for (gc_region *r = t->region; r; r = r->prev) {
+        for (int a = 0; a < 2; a++) {
+            for (gc_region_chunk *c = a ? r->atomic : r->scan; c; c = c->next) {
+                char *start = (char*)c + GC_REGION_FIRST;
+                if ((const char*)ptr > start && (const char*)ptr < start + c->used) {
+                    *chunk = c;
+                    *atomic = a;
+                    return r;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// Is the object the last one bumped out of its chunk
+static inline bool region_last(gc_region_chunk *c, const void *ptr) {
+    return (const char*)ptr + region_footprint(*region_header(ptr)) - GC_REGION_HEADER ==
+           (char*)c + GC_REGION_FIRST + c->used;
+}
+
+// Resize a region object in its own region: in place when it is the last
+// one of its chunk and the chunk has room, otherwise by copying
+static void* region_realloc(gc_state *gc, gc_region *r, gc_region_chunk *c, bool atomic, void *ptr, size_t size) {
+    size_t old_size = *region_header(ptr);
+    size_t old_total = region_footprint(old_size), total = region_footprint(size);
+    if (total <= old_total || (region_last(c, ptr) && c->size - c->used >= total - old_total)) {
+        if (total > old_total) {
+            c->used += total - old_total;
+            r->bytes += total - old_total;
+        }
+        if (total < old_total && region_last(c, ptr)) {
+            c->used -= old_total - total;
+            r->bytes -= old_total - total;
+        }
+        // The size is recorded either way, a shrink clears what it gives up
+        // since region chunks are scanned whole
+        if (!atomic && size > old_size) memset((char*)ptr + old_size, 0, size - old_size);
+        if (!atomic && size < old_size) memset((char*)ptr + size, 0, old_size - size);
+        *region_header(ptr) = size;
+        return ptr;
+    }
+    void *new_ptr = region_alloc(gc, r, size, atomic, *region_layout(ptr));
+    memcpy(new_ptr, ptr, old_size);
+    return new_ptr;
+}
+
+// The last object of a chunk can be handed back, others stay until the
+// region ends
+static void region_free(gc_region *r, gc_region_chunk *c, void *ptr) {
+    if (!region_last(c, ptr)) return;
+    size_t total = region_footprint(*region_header(ptr));
+    c->used -= total;
+    r->bytes -= total;
+    r->objects--;
+}
+
+// A thread's regions are roots, the pointer-free chunks need no scan
+static void scan_regions(gc_state *gc, scan_fn scan, gc_thread *t) {
+    for (gc_region *r = t->region; r; r = r->prev) {
+        for (gc_region_chunk *c = r->scan; c; c = c->next) {
+            char *start = (char*)c + GC_REGION_FIRST;
+            scan(gc, start, start + c->used);
+        }
+    }
+}
+
+static void profile_release_region(gc_state *gc, gc_region *region);
+static void profile_move(gc_state *gc, void *from, void *to);
+static void profile_scan(gc_state *gc, bool full);
+
+// Drop a thread's open regions, with the lock held
+static void release_regions(gc_state *gc, gc_thread *t) {
+    while (t->region) {
+        gc_region *r = t->region;
+        t->region = r->prev;
+        region_free_chunks(gc, r->scan);
+        region_free_chunks(gc, r->atomic);
+        if (gc->profile) profile_release_region(gc, r);
+        free(r);
+    }
+}
+
+// ---- Stack scanning --------------------------------------------------------
+
+static void scan_stack(gc_state *gc, scan_fn scan, void *top, void *bot) {
+    if (top > bot) { void *t = top; top = bot; bot = t; }
+    scan(gc, top, bot);
+}
+
+// Registers, stacks and registered roots, each range handed to scan
+// (scan_range_for_ptrs to mark, or compaction's pinning scan)
+static void scan_roots(gc_state *gc, scan_fn scan) {
+    // Save registers using setjmp and scan them
+    jmp_buf regs;
+    setjmp(regs);
+    
+    // Scan the jmp_buf for pointers
+    // jmp_buf is an array type, so we scan it as a memory region
+    scan(gc, &regs, (char*)&regs + sizeof(regs));
+    
+    // mark: stacks + roots (and contents). Other threads are stopped and
+    // saved their registers and stack pointer.
+    gc_thread *self = gc_current_thread;
+    void *top;
+    GC_GET_STACK_POINTER(&top);
+    scan_stack(gc, scan, top, self->stack_bottom);
+    for (gc_thread *t = gc->threads; t; t = t->next) {
+        scan_regions(gc, scan, t);
+        if (t == self) continue;
+        scan(gc, &t->regs, (char*)&t->regs + sizeof(t->regs));
+        scan_stack(gc, scan, t->stack_top, t->stack_bottom);
+    }
+    for (size_t i = 0; i < gc->root_count; i++) {
+        gc_root *r = &gc->roots[i];
+        // Mark the pointer in case the root is a gc heap object.
+        scan(gc, &r->ptr, &r->ptr + 1);
+        // Scan the range manually for the case it is not a gc heap object.
+        scan(gc, r->ptr, (char*)r->ptr + r->size);
+    }
+}
+
+// ---- Dirty page tracking ---------------------------------------------------
+
+// Incremental marking lets the program modify objects that were already
+// scanned. Rather than a write barrier, the kernel's soft-dirty page bits
+// tell us which pages were written since marking started: writing "4" to
+// /proc/self/clear_refs resets them and bit 55 of each /proc/self/pagemap
+// entry reports them.
+
+#define PAGEMAP_SOFT_DIRTY ((uint64_t)1 << 55)
+
+static void vdb_disable(gc_state *gc) {
+    if (gc->vdb_pagemap_fd >= 0) close(gc->vdb_pagemap_fd);
+    if (gc->vdb_clear_refs_fd >= 0) close(gc->vdb_clear_refs_fd);
+    gc->vdb_pagemap_fd = gc->vdb_clear_refs_fd = -1;
+}
+
+static bool vdb_clear(gc_state *gc) {
+    gc->vdb_window_len = 0;
+    return write(gc->vdb_clear_refs_fd, "4", 1) == 1;
+}
+
+static int vdb_page_dirty(gc_state *gc, uintptr_t page) {
+    if (page < gc->vdb_window_first || page >= gc->vdb_window_first + gc->vdb_window_len) {
+        ssize_t n = pread(gc->vdb_pagemap_fd, gc->vdb_window, GC_VDB_WINDOW * sizeof(uint64_t),
+                          (off_t)(page * sizeof(uint64_t)));
+        if (n < (ssize_t)sizeof(uint64_t)) return -1;
+        gc->vdb_window_first = page;
+        gc->vdb_window_len = (size_t)n / sizeof(uint64_t);
+    }
+    return (gc->vdb_window[page - gc->vdb_window_first] & PAGEMAP_SOFT_DIRTY) != 0;
+}
+
+// Probe once for working soft-dirty bits (needs CONFIG_MEM_SOFT_DIRTY)
+static void vdb_init(gc_state *gc) {
+    gc->vdb_checked = true;
+    gc->vdb_pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    gc->vdb_clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (gc->vdb_pagemap_fd < 0 || gc->vdb_clear_refs_fd < 0) { vdb_disable(gc); return; }
+    if (!gc->vdb_window) {
+        gc->vdb_window = (uint64_t*)malloc(GC_VDB_WINDOW * sizeof(uint64_t));
+        if (!gc->vdb_window) { fprintf(stderr, "vdb_init: OOM\n"); exit(1); }
+    }
+    
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    volatile char *probe = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (probe == MAP_FAILED) { vdb_disable(gc); return; }
+    uintptr_t page = (uintptr_t)probe / page_size;
+    probe[0] = 1;
+    bool ok = vdb_clear(gc) && vdb_page_dirty(gc, page) == 0;
+    probe[0] = 2;
+    gc->vdb_window_len = 0;
+    ok = ok && vdb_page_dirty(gc, page) == 1;
+    munmap((void*)probe, page_size);
+    if (!ok) vdb_disable(gc);
+}
+
+static bool vdb_available(gc_state *gc) {
+    if (!gc->vdb_checked) vdb_init(gc);
+    return gc->vdb_pagemap_fd >= 0;
+}
+
+// Resetting the bits costs every page a fault on its next write, so it is
+// only done when something reads them: incremental marking, or minor
+// collections with an old space too big to scan whole
+static bool vdb_wanted(gc_state *gc) {
+    return gc->incremental_step_us > 0 ||
+           gc->allocated_bytes - gc->young_bytes >= GC_VDB_REMEMBERED_MIN;
+}
+
+// Queue the written parts of an object for rescanning
+static void rescan_if_dirty(gc_state *gc, char *start, char *end, size_t page_size) {
+    if (start == end) return;
+    uintptr_t first = (uintptr_t)start / page_size, last = ((uintptr_t)end - 1) / page_size;
+    for (uintptr_t page = first; page <= last; page++) {
+        if (vdb_page_dirty(gc, page) == 0) continue;
+        char *lo = (char*)(page * page_size), *hi = lo + page_size;
+        mark_stack_push(gc, lo > start ? lo : start, hi < end ? hi : end);
+    }
+}
+
+// ---- Weak references -------------------------------------------------------
+
+// Whether a collection that just finished marking will free the object at
+// ptr. Minor collections only free page objects. Anything that isn't a
+// heap object is never freed.
+static bool doomed(gc_state *gc, void *ptr, bool minor) {
+    gc_page *p = find_page(gc, ptr);
+    if (p) {
+        size_t slot = page_find_slot(p, ptr);
+        return slot == SIZE_MAX || !bit_test(p->mark_bits, slot);
+    }
+    if (minor) return false;
+    gc_entry *e = find_entry(gc, ptr, &gc->stats.cache_hits, &gc->stats.cache_misses);
+    return e && !entry_marked(e);
+}
+
+// Clear references to objects about to be freed and forget references
+// that are about to be freed themselves, with the other threads stopped
+static void clear_weak_refs(gc_state *gc, bool minor) {
+    size_t n = 0;
+    for (size_t i = 0; i < gc->weak_count; i++) {
+        gc_weak *w = gc->weak_refs[i];
+        if (doomed(gc, w, minor)) continue;
+        if (w->target && doomed(gc, w->target, minor)) w->target = NULL;
+        gc->weak_refs[n++] = w;
+    }
+    gc->weak_count = n;
+}
+
+// ---- Compaction ------------------------------------------------------------
+
+// Runs at the end of a full collection's marking with the other threads
+// stopped (see "Compaction" in gc.h). Pages being emptied get an
+// evacuation record in a table mapped for the occasion, since malloc may be
+// locked by a stopped thread.
+
+// Pin the object a possible pointer hits if its page is being emptied
+static inline void pin_candidate(gc_state *gc, void *ptr) {
+    gc_page *p = find_page(gc, ptr);
+    if (!p || !p->evac) return;
+    size_t slot = page_find_slot(p, ptr);
+    if (slot != SIZE_MAX) bit_set(p->evac->pinned, slot);
+}
+
+static void pin_range(gc_state *gc, void *start, void *end) {
+    void *cands[GC_SCAN_BATCH];
+    for (void **p = (void**)start, **q = (void**)end; p < q;) {
+        size_t n = filter_words(gc, &p, q, cands);
+        for (size_t i = 0; i < n; i++) pin_candidate(gc, cands[i]);
+    }
+}
+
+// Pin everything a conservative reference points at: the roots, live
+// untyped objects and the pressure callbacks' arguments
+static void pin_conservative(gc_state *gc) {
+    scan_roots(gc, pin_range);
+    for (size_t i = 0; i < gc->alloc_count; i++) {
+        gc_entry *e = &gc->allocs[i];
+        if (entry_marked(e) && !entry_atomic(e))
+            pin_range(gc, entry_ptr(e), (char*)entry_ptr(e) + e->size);
+    }
+    for (size_t i = 0; i < gc->page_count; i++) {
+        gc_page *p = gc->pages[i];
+        for (size_t w = 0; w < page_words(p); w++) {
+            uint64_t bits = p->alloc_bits[w] & p->mark_bits[w] & ~p->atomic_bits[w] & ~p->typed_bits[w];
+            for (; bits; bits &= bits - 1) {
+                char *start = slot_ptr(p, w * 64 + __builtin_ctzll(bits));
+                pin_range(gc, start, start + p->size);
+            }
+        }
+    }
+    for (size_t i = 0; i < gc->pressure_count; i++)
+        pin_candidate(gc, gc->pressure_callbacks[i].data);
+}
+
+// Free slot of class cls outside the pages being emptied, NULL when there
+// is none. The search resumes at *dst. Spare pages are used once the class
+// is full, but only while the pages array has room: nothing is allocated.
+static char* evacuation_slot(gc_state *gc, size_t cls, gc_page **dst) {
+    gc_page *p = *dst ? *dst : gc->class_pages[cls], *last = NULL;
+    for (; p; last = p, p = p->next) {
+        if (p->evac) continue;
+        size_t slot = next_clear_bit(p->alloc_bits, 0, p->slots);
+        if (slot < p->slots) {
+            *dst = p;
+            bit_set(p->alloc_bits, slot);
+            bit_set(p->mark_bits, slot);
+            p->live++;
+            gc->allocated_bytes += p->size;
+            gc->page_object_count++;
+            return slot_ptr(p, slot);
+        }
+    }
+    if (!gc->free_pages || gc->page_count >= gc->page_capacity) return NULL;
+    p = gc->free_pages;
+    gc->free_pages = p->next;
+    gc->free_page_count--;
+    init_page(gc, p, cls);
+    if (last) last->next = p;
+    else gc->class_pages[cls] = p;
+    *dst = p;
+    return evacuation_slot(gc, cls, dst);
+}
+
+// Copy the unpinned live objects of a page elsewhere, leaving their
+// addresses behind. Their old slots are unmarked so the sweep frees them.
+static void evacuate_page(gc_state *gc, gc_page *p, gc_page **dst) {
+    gc_cycle *c = &gc->cycle;
+    for (size_t w = 0; w < page_words(p); w++) {
+        uint64_t bits = p->alloc_bits[w] & p->mark_bits[w] & ~p->evac->pinned[w];
+        for (; bits; bits &= bits - 1) {
+            size_t slot = w * 64 + __builtin_ctzll(bits);
+            char *to = evacuation_slot(gc, p->size_class, dst);
+            if (!to) return;
+            char *from = slot_ptr(p, slot);
+            memcpy(to, from, p->size);
+            gc_page *q = find_page(gc, to);
+            size_t to_slot = page_find_slot(q, to);
+            if (bit_test(p->atomic_bits, slot)) bit_set(q->atomic_bits, to_slot);
+            if (bit_test(p->typed_bits, slot)) bit_set(q->typed_bits, to_slot);
+            bit_clear(p->mark_bits, slot);
+            bit_set(p->evac->moved, slot);
+            if (gc->profile) {
+                size_t header = bit_test(p->typed_bits, slot) ? GC_TYPED_HEADER : 0;
+                profile_move(gc, from + header, to + header);
+            }
+            *(char**)from = to;
+            c->moved_count++;
+            c->moved_bytes += p->size;
+        }
+    }
+}
+
+// Point a reference to a moved object at its copy, keeping any offset
+static inline void forward(gc_state *gc, void **ref) {
+    void *ptr = *ref;
+    gc_page *p = find_page(gc, ptr);
+    if (!p || !p->evac) return;
+    size_t slot = page_find_slot(p, ptr);
+    if (slot == SIZE_MAX || !bit_test(p->evac->moved, slot)) return;
+    char *old = slot_ptr(p, slot);
+    *ref = *(char**)old + ((char*)ptr - old);
+}
+
+// Rewrite the pointer words of a typed object, walking its layout as
+// scan_typed does
+static void forward_typed(gc_state *gc, char *header, char *end) {
+    const gc_layout *layout = *(const gc_layout**)header;
+    for (char *elem = header + GC_TYPED_HEADER; elem < end; elem += layout->size) {
+        uint64_t bits = layout->ptr_words;
+        size_t fit = (size_t)(end - elem) / sizeof(void*);
+        if (fit < 64) bits &= ((uint64_t)1 << fit) - 1;
+        for (; bits; bits &= bits - 1)
+            forward(gc, &((void**)elem)[__builtin_ctzll(bits)]);
+    }
+}
+
+// Update every precise reference to a moved object: the pointer words of
+// live typed objects (the copies included) and the weak references
+static void forward_references(gc_state *gc) {
+    for (size_t i = 0; i < gc->page_count; i++) {
+        gc_page *p = gc->pages[i];
+        for (size_t w = 0; w < page_words(p); w++) {
+            uint64_t bits = p->alloc_bits[w] & p->mark_bits[w] & p->typed_bits[w];
+            for (; bits; bits &= bits - 1) {
+                char *start = slot_ptr(p, w * 64 + __builtin_ctzll(bits));
+                forward_typed(gc, start, start + p->size);
+            }
+        }
+    }
+    for (size_t i = 0; i < gc->weak_count; i++) {
+        forward(gc, (void**)&gc->weak_refs[i]);
+        forward(gc, &gc->weak_refs[i]->target);
+    }
+}
+
+// Empty the sparse pages if there are enough of them
+static void compact_pages(gc_state *gc) {
+    size_t limit[GC_SIZE_CLASSES], sparse = 0;
+    for (size_t cls = 0; cls < GC_SIZE_CLASSES; cls++)
+        limit[cls] = (GC_PAGE_SIZE - GC_PAGE_FIRST) / class_size(cls) / GC_COMPACT_SPARSE;
+    for (size_t i = 0; i < gc->page_count; i++) {
+        gc_page *p = gc->pages[i];
+        if (p->size_class == GC_LARGE_CLASS) continue;
+        size_t live = 0;
+        for (size_t w = 0; w < page_words(p); w++)
+            live += __builtin_popcountll(p->alloc_bits[w] & p->mark_bits[w]);
+        // Wholly dead pages are the sweep's business
+        if (live > 0 && live <= limit[p->size_class]) sparse++;
+    }
+    if (sparse < GC_COMPACT_MIN_PAGES) return;
+    
+    size_t len = sparse * sizeof(gc_evacuation);
+    gc_evacuation *table = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) return;
+    // Pages taken as destinations are added past the ones counted here
+    size_t pages = gc->page_count, n = 0;
+    for (size_t i = 0; i < pages && n < sparse; i++) {
+        gc_page *p = gc->pages[i];
+        if (p->size_class == GC_LARGE_CLASS) continue;
+        size_t live = 0;
+        for (size_t w = 0; w < page_words(p); w++)
+            live += __builtin_popcountll(p->alloc_bits[w] & p->mark_bits[w]);
+        if (live > 0 && live <= limit[p->size_class]) p->evac = &table[n++];
+    }
+    
+    pin_conservative(gc);
+    gc_page *dst[GC_SIZE_CLASSES] = { NULL };
+    for (size_t i = 0; i < pages; i++)
+        if (gc->pages[i]->evac) evacuate_page(gc, gc->pages[i], &dst[gc->pages[i]->size_class]);
+    forward_references(gc);
+    
+    for (size_t i = 0; i < pages; i++)
+        gc->pages[i]->evac = NULL;
+    munmap(table, len);
+    gc_cycle *c = &gc->cycle;
+    gc->stats.compactions++;
+    gc->stats.moved_objects += c->moved_count;
+    gc->stats.moved_bytes += c->moved_bytes;
+    if (gc->debug_print_stats) {
+        fprintf(stderr, "GC compact: moved %zu objects (%zu bytes) out of %zu sparse pages\n",
+                c->moved_count, c->moved_bytes, sparse);
+    }
+}
+
+// ---- Collection cycle ------------------------------------------------------
+
+// A cycle moves through setup, mark and sweep. Each phase is broken into
+// small units of work so incremental mode can stop after any of them; a
+// stop-the-world collection just runs every unit back to back.
+
+// Entries that survived the last cycle are still sorted (and unmarked, the
+// sweep clears their marks), so setup only sorts the entries appended since
+// then and merges them in, updating the direct mapped cache as they move.
+
+enum {
+    SETUP_RADIX,        // Radix sort the appended entries, one digit per unit
+    SETUP_MERGE,        // Merge them into the sorted prefix
+    SETUP_CACHE,        // Resize and clear the cache if the table outgrew it
+    SETUP_CACHE_FILL,   // Repopulate a resized cache
+};
+
+// Helper to get time in microseconds
+static double get_time_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+// Queue marked, pointer-bearing page objects for scanning. With dirty_only
+// just the parts on pages written since the dirty bits were last cleared.
+static void push_marked_page_objects(gc_state *gc, bool dirty_only, size_t page_size) {
+    for (size_t i = 0; i < gc->page_count; i++) {
+        gc_page *p = gc->pages[i];
+        for (size_t w = 0; w < page_words(p); w++) {
+            uint64_t bits = p->alloc_bits[w] & p->mark_bits[w] & ~p->atomic_bits[w];
+            while (bits) {
+                size_t slot = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if (dirty_only) {
+                    char *start = slot_ptr(p, slot);
+                    rescan_if_dirty(gc, start, start + p->size, page_size);
+                } else {
+                    gc_mark_range r = page_object_range(gc, p, slot);
+                    mark_stack_push(gc, r.start, r.end);
+                }
+            }
+        }
+    }
+}
+
+// Don't hold on to a mark stack grown by an unusually deep heap
+static void shrink_mark_stack(gc_state *gc) {
+    if (gc->mark_stack_capacity > GC_INITIAL_MARK_STACK * 64) {
+        if (!resize_mark_stack(gc, GC_INITIAL_MARK_STACK)) {
+            fprintf(stderr, "gc_collect: OOM (shrink mark stack)\n");
+            exit(1);
+        }
+    }
+}
+
+// Statistics: the heap is at its largest when a collection starts
+static void note_peak(gc_state *gc) {
+    if (gc->allocated_bytes > gc->stats.peak_bytes) gc->stats.peak_bytes = gc->allocated_bytes;
+}
+
+static void note_pause(gc_state *gc, double us) {
+    gc_stats *s = &gc->stats;
+    size_t bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && us >= (double)(1ull << (bucket + GC_PAUSE_BUCKET_SHIFT))) bucket++;
+    s->pause_buckets[bucket]++;
+    s->pauses++;
+    s->pause_total_us += us;
+    if (us > s->pause_max_us) s->pause_max_us = us;
+}
+
+static void begin_cycle(gc_state *gc, bool incremental) {
+    gc_cycle *c = &gc->cycle;
+    memset(c, 0, sizeof(*c));
+    c->begin_us = get_time_us();
+    c->incremental = incremental;
+    c->count = gc->alloc_count;
+    c->setup_stage = SETUP_RADIX;
+    if (c->count > gc->sorted_count) {
+        c->tmp = (gc_entry*)malloc((c->count - gc->sorted_count) * sizeof(gc_entry));
+        if (!c->tmp) { fprintf(stderr, "gc_collect: OOM (sort buffer)\n"); exit(1); }
+    }
+    // Reset scan counters
+    gc->bytes_scanned = 0;
+    gc->bytes_skipped = 0;
+    gc->bytes_typed = 0;
+    // These allocate, do them before marking stops the other threads
+    if (vdb_wanted(gc)) vdb_available(gc);
+    start_mark_helpers(gc);
+    c->background_sweep = gc->sweeper_started;
+    
+    // Closes the lock-free allocation path, which has to be empty
+    stop_world(gc);
+    c->old_count = gc->alloc_count + gc->page_object_count;
+    c->old_bytes = gc->allocated_bytes;
+    note_peak(gc);
+    c->phase = GC_PHASE_SETUP;
+    resume_world(gc);
+}
+
+static void begin_mark(gc_state *gc) {
+    gc_cycle *c = &gc->cycle;
+    c->phase = GC_PHASE_MARK;
+    if (c->incremental && vdb_available(gc)) {
+        c->dirty_tracking = vdb_clear(gc);
+        if (!c->dirty_tracking) vdb_disable(gc);
+    }
+    
+    // Page objects keep their marks between cycles (marked means old), a
+    // full collection starts them all over as unmarked
+    for (size_t i = 0; i < gc->page_count; i++) {
+        gc_page *p = gc->pages[i];
+        memset(p->mark_bits, 0, page_words(p) * sizeof(uint64_t));
+    }
+    
+    // Widen the table's bounds from setup to cover the pages
+    if (gc->page_count > 0) {
+        if (!gc->heap_min || gc->page_min < gc->heap_min) gc->heap_min = gc->page_min;
+        if (!gc->heap_max || gc->page_max > gc->heap_max) gc->heap_max = gc->page_max;
+    }
+    
+    // Drop the scan filter's bits for memory that has gone since
+    memset(gc->scan_filter, 0, GC_FILTER_BITS / 8);
+    for (size_t i = 0; i < gc->arena_count; i++)
+        filter_add(gc, gc->arenas[i], GC_ARENA_SIZE);
+    for (size_t i = 0; i < gc->page_count; i++) {
+        gc_page *p = gc->pages[i];
+        if (p->size_class == GC_LARGE_CLASS) filter_add(gc, p, large_mapping_size(p->size));
+    }
+    for (size_t i = 0; i < gc->alloc_count; i++)
+        filter_add(gc, entry_ptr(&gc->allocs[i]), gc->allocs[i].size);
+    
+    // Allocations made during setup are marked but were never scanned
+    for (size_t i = c->count; i < gc->alloc_count; i++) {
+        gc_entry *e = &gc->allocs[i];
+        if (!entry_atomic(e)) mark_stack_push(gc, entry_ptr(e), (char*)entry_ptr(e) + e->size);
+    }
+    scan_roots(gc, scan_range_for_ptrs);
+}
+
+// Final, uninterrupted part of marking. If the program ran since marking
+// started, rescan the roots and whatever it wrote to already marked objects.
+static void finish_mark(gc_state *gc) {
+    gc_cycle *c = &gc->cycle;
+    if (c->mutator_ran && c->dirty_tracking) {
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        for (size_t i = 0; i < gc->alloc_count; i++) {
+            gc_entry *e = &gc->allocs[i];
+            if (entry_marked(e) && !entry_atomic(e))
+                rescan_if_dirty(gc, entry_ptr(e), (char*)entry_ptr(e) + e->size, page_size);
+        }
+        push_marked_page_objects(gc, true, page_size);
+        scan_roots(gc, scan_range_for_ptrs);
+    }
+    mark_all(gc);
+    shrink_mark_stack(gc);
+    clear_weak_refs(gc, false);
+    if (gc->compact && gc->typed_scan) compact_pages(gc);
+    c->phase = GC_PHASE_SWEEP;
+    c->pos = 0;
+    c->sweep_write = 0;
+    c->sweep_page = 0;
+}
+
+// One unit of setup work, returns true when setup is complete
+static bool setup_unit(gc_state *gc) {
+    gc_cycle *c = &gc->cycle;
+    size_t n = c->count;
+    switch (c->setup_stage) {
+    case SETUP_RADIX: {
+        // LSD radix sort of the tail, c->pos is the digit's shift. Passes
+        // alternate between the table and tmp, the result goes to tmp.
+        size_t t = n - gc->sorted_count;
+        gc_entry *tail = gc->allocs + gc->sorted_count;
+        if (c->pos >= sizeof(uintptr_t) * 8) {
+            if (!c->in_tmp) memcpy(c->tmp, tail, t * sizeof(gc_entry));
+            c->i = gc->sorted_count;
+            c->j = t;
+            c->pos = n;
+            c->setup_stage = SETUP_MERGE;
+            return false;
+        }
+        gc_entry *src = c->in_tmp ? c->tmp : tail;
+        gc_entry *dst = c->in_tmp ? tail : c->tmp;
+        unsigned shift = (unsigned)c->pos;
+        uintptr_t mask = ((uintptr_t)1 << GC_RADIX_BITS) - 1;
+        size_t counts[1 << GC_RADIX_BITS] = {0};
+        c->pos += GC_RADIX_BITS;
+        for (size_t k = 0; k < t; k++)
+            counts[((uintptr_t)entry_ptr(&src[k]) >> shift) & mask]++;
+        // Skip digits that all entries share, like the high bytes
+        if (t == 0 || counts[((uintptr_t)entry_ptr(&src[0]) >> shift) & mask] == t) return false;
+        size_t sum = 0;
+        for (size_t d = 0; d <= mask; d++) {
+            size_t cnt = counts[d];
+            counts[d] = sum;
+            sum += cnt;
+        }
+        for (size_t k = 0; k < t; k++)
+            dst[counts[((uintptr_t)entry_ptr(&src[k]) >> shift) & mask]++] = src[k];
+        c->in_tmp = !c->in_tmp;
+        return false;
+    }
+    case SETUP_MERGE: {
+        // Backwards so the prefix can be merged in place: c->i and c->j count
+        // the prefix and tail entries left, c->pos is the output cursor.
+        // Prefix entries below the lowest new one don't move.
+        for (size_t k = 0; k < GC_STEP_ENTRIES && c->j > 0; k++) {
+            gc_entry *e;
+            if (c->i > 0 && entry_ptr(&gc->allocs[c->i - 1]) > entry_ptr(&c->tmp[c->j - 1]))
+                e = &gc->allocs[--c->i];
+            else
+                e = &c->tmp[--c->j];
+            gc->allocs[--c->pos] = *e;
+            cache_entry(gc, &gc->allocs[c->pos]);
+        }
+        if (c->j > 0) return false;
+        free(c->tmp);
+        c->tmp = NULL;
+        
+        // Record heap bounds for the scanner's range check
+        if (n > 0) {
+            gc_entry *last = &gc->allocs[n - 1];
+            gc->heap_min = entry_ptr(&gc->allocs[0]);
+            gc->heap_max = (char*)entry_ptr(last) + last->size;
+        } else {
+            gc->heap_min = gc->heap_max = NULL;
+        }
+        c->pos = 0;
+        c->setup_stage = SETUP_CACHE;
+        return false;
+    }
+    case SETUP_CACHE: {
+        if (c->pos == 0) {
+            // Calculate desired cache size (minimum 16)
+            size_t desired_size = n > 16 ? next_power_of_2(n) : 16;
+            
+            // Reallocate cache if needed (too small or more than 4x too large),
+            // otherwise the merge already left it up to date
+            if (gc->cache_size >= desired_size && gc->cache_size <= desired_size * 4) return true;
+            gc_entry **new_cache = (gc_entry**)realloc(gc->cache, desired_size * sizeof(gc_entry*));
+            if (!new_cache) { fprintf(stderr, "gc_collect: OOM (cache)\n"); exit(1); }
+            gc->cache = new_cache;
+            gc->cache_size = desired_size;
+            gc->cache_mask = desired_size - 1;
+        }
+        size_t len = gc->cache_size - c->pos < GC_STEP_ENTRIES * 16 ? gc->cache_size - c->pos : GC_STEP_ENTRIES * 16;
+        memset(gc->cache + c->pos, 0, len * sizeof(gc_entry*));
+        c->pos += len;
+        if (c->pos >= gc->cache_size) {
+            c->pos = 0;
+            c->setup_stage = SETUP_CACHE_FILL;
+        }
+        return false;
+    }
+    case SETUP_CACHE_FILL: {
+        size_t end = c->pos + GC_STEP_ENTRIES < n ? c->pos + GC_STEP_ENTRIES : n;
+        for (size_t i = c->pos; i < end; i++) {
+            void *ptr = entry_ptr(&gc->allocs[i]);
+            size_t index = dm_cache_idx(gc, ptr);
+            gc->cache[index] = &gc->allocs[i];
+        }
+        c->pos = end;
+        return c->pos >= n;
+    }
+    }
+    return true;
+}
+
+// One unit of sweep work over the cycle's entries and then the pages,
+// returns true when done
+static bool sweep_unit(gc_state *gc) {
+    gc_cycle *c = &gc->cycle;
+    if (c->pos >= c->count) {
+        // Pages added meanwhile only hold marked objects
+        size_t end = c->sweep_page + GC_STEP_PAGES < gc->page_count ? c->sweep_page + GC_STEP_PAGES : gc->page_count;
+        while (c->sweep_page < end)
+            sweep_page(gc, gc->pages[c->sweep_page++], &c->freed_count, &c->freed_bytes);
+        return c->sweep_page >= gc->page_count;
+    }
+    size_t end = c->pos + GC_STEP_ENTRIES < c->count ? c->pos + GC_STEP_ENTRIES : c->count;
+    for (size_t read_pos = c->pos; read_pos < end; read_pos++) {
+        gc_entry *e = &gc->allocs[read_pos];
+        if (entry_marked(e)) {
+            // Keep marked entry, unmarked for the next cycle
+            entry_set_marked(e, 0);
+            if (c->sweep_write != read_pos) {
+                gc->allocs[c->sweep_write] = *e;
+                cache_entry(gc, &gc->allocs[c->sweep_write]);
+            }
+            c->sweep_write++;
+        } else {
+            // Free unmarked entry, or leave that to the sweeper once it
+            // lets go of the lock
+            uncache_entry(gc, e);
+            if (gc->sweep_batch && gc->sweep_batch_count < GC_SWEEP_BATCH)
+                gc->sweep_batch[gc->sweep_batch_count++] = entry_ptr(e);
+            else
+                free(entry_ptr(e));
+            gc->allocated_bytes -= e->size;
+            c->freed_count++;
+            c->freed_bytes += e->size;
+        }
+    }
+    c->pos = end;
+    return false;
+}
+
+static void finish_sweep(gc_state *gc) {
+    gc_cycle *c = &gc->cycle;
+    
+    // Close the gap left by freed entries, keeping allocations made during the cycle
+    size_t tail = gc->alloc_count - c->count;
+    if (tail > 0 && c->sweep_write != c->count) {
+        memmove(gc->allocs + c->sweep_write, gc->allocs + c->count, tail * sizeof(gc_entry));
+    }
+    gc->alloc_count = c->sweep_write + tail;
+    gc->sorted_count = c->sweep_write;
+    for (size_t i = gc->sorted_count; i < gc->alloc_count; i++)
+        entry_set_marked(&gc->allocs[i], 0);
+    
+    // Shrink the allocations array if it's more than 4x too large
+    if (gc->alloc_capacity > gc->alloc_count * 4 && gc->alloc_capacity > GC_INITIAL_ALLOC_SIZE) {
+        size_t new_capacity = gc->alloc_count * 2;
+        if (new_capacity < GC_INITIAL_ALLOC_SIZE) {
+            new_capacity = GC_INITIAL_ALLOC_SIZE;
+        }
+        gc_entry *new_allocs = (gc_entry*)realloc(gc->allocs, new_capacity * sizeof(gc_entry));
+        if(!new_allocs) { fprintf(stderr, "gc_collect: OOM (shrink allocs)\n"); exit(1); }
+        rebase_cache(gc, new_allocs);
+        gc->allocs = new_allocs;
+        gc->alloc_capacity = new_capacity;
+    }
+    
+    release_empty_pages(gc);
+    
+    // Reopens the lock-free allocation path, after the cursor resets
+    __atomic_store_n(&c->phase, GC_PHASE_IDLE, __ATOMIC_RELEASE);
+    c->count = 0;
+    gc->major_count++;
+    // Slots vacated by compaction were swept like dead ones
+    c->freed_count -= c->moved_count;
+    c->freed_bytes -= c->moved_bytes;
+    gc->stats.bytes_scanned += gc->bytes_scanned;
+    gc->stats.freed_objects += c->freed_count;
+    gc->stats.freed_bytes += c->freed_bytes;
+    gc->idle_base_bytes = gc->allocated_bytes - gc->young_bytes;
+    
+    // Start a fresh remembered set for the next minor collection
+    gc->remembered_clean = vdb_wanted(gc) && vdb_available(gc) && vdb_clear(gc);
+    if (gc->profile) profile_scan(gc, true);  // The dead are known, the rest survived
+}
+
+// Smoothed measurement, the first one taken as is
+static double smooth(double old, double sample) {
+    return old > 0 ? (old + sample) / 2 : sample;
+}
+
+// Size the threshold once a cycle is over and its phase times are final
+static void adjust_threshold(gc_state *gc, double now) {
+    gc_cycle *c = &gc->cycle;
+    // Judge the heap by what survived, a background sweep lets the program
+    // allocate meanwhile
+    size_t live = c->background_sweep ? c->old_bytes - c->freed_bytes : gc->allocated_bytes;
+    live += gc->region_bytes;  // Live until their regions end
+    if (gc->pressure_limit) {
+        // Pressure callbacks next run near the limit, or once the heap grows
+        // by 1/8 of it if what survived is already that close
+        size_t near = gc->pressure_limit - gc->pressure_limit / 8;
+        size_t next = live + gc->pressure_limit / 8;
+        gc->pressure_next = next > near ? next : near;
+    }
+    if (gc->target_pause_us <= 0 && gc->target_gc_share <= 0) {
+        if (live > (gc->threshold * 3) / 4) gc->threshold *= 2;
+        return;
+    }
+    
+    double heap = c->old_bytes ? (double)c->old_bytes : 1;
+    gc->mark_cost_us = smooth(gc->mark_cost_us, c->mark_us);
+    gc->heap_cost_us = smooth(gc->heap_cost_us, (c->setup_us + c->sweep_us) / heap);
+    gc->pause_heap_cost_us = smooth(gc->pause_heap_cost_us,
+                                    (c->setup_us + (c->background_sweep ? 0 : c->sweep_us)) / heap);
+    if (gc->last_cycle_end_us > 0 && c->begin_us > gc->last_cycle_end_us && c->old_bytes > gc->last_live_bytes)
+        gc->alloc_rate = smooth(gc->alloc_rate, (c->old_bytes - gc->last_live_bytes) / (c->begin_us - gc->last_cycle_end_us));
+    gc->last_cycle_end_us = now;
+    gc->last_live_bytes = live;
+    
+    double floor = live + live / 4 > DEFAULT_GC_THRESHOLD ? live + live / 4 : DEFAULT_GC_THRESHOLD;
+    double want = gc->threshold;
+    if (gc->target_gc_share > 0 && gc->target_gc_share < 1 && gc->alloc_rate > 0) {
+        // A cycle costs mark + heap_cost * H and comes around every
+        // (H - live) / alloc_rate of program time. Collection time allowed
+        // per byte allocated is k, so H >= (mark + k * live) / (k - heap_cost).
+        // When no heap size gets there, grow as if there were no target.
+        double k = gc->target_gc_share / (1 - gc->target_gc_share) / gc->alloc_rate;
+        if (k > gc->heap_cost_us) want = (gc->mark_cost_us + k * live) / (k - gc->heap_cost_us);
+        else if (live > (gc->threshold * 3) / 4) want = gc->threshold * 2.0;
+    }
+    if (gc->target_pause_us > 0 && !c->incremental && gc->pause_heap_cost_us > 0) {
+        double cap = (gc->target_pause_us - gc->mark_cost_us) / gc->pause_heap_cost_us;
+        if (gc->target_gc_share <= 0 || cap < want) want = cap;
+    }
+    
+    if (want > gc->threshold * 4.0) want = gc->threshold * 4.0;
+    if (want < gc->threshold / 2.0) want = gc->threshold / 2.0;
+    if (want < floor) want = floor;
+    gc->threshold = (size_t)want;
+}
+
+static void print_cycle_stats(gc_state *gc) {
+    gc_cycle *c = &gc->cycle;
+    double total_time = c->setup_us + c->mark_us + c->sweep_us;
+    if (c->incremental) {
+        fprintf(stderr, "GC: %zu->%zu allocs, %zu->%zu bytes (freed %zu/%zu), scanned %zu bytes (skipped %zu atomic, %zu typed), %.0fus in %zu steps, max pause %.0fus (setup:%.1f%% mark:%.1f%% sweep:%.1f%%)\n",
+                c->old_count, gc->alloc_count + gc->page_object_count,
+                c->old_bytes, gc->allocated_bytes,
+                c->freed_count, c->freed_bytes,
+                gc->bytes_scanned, gc->bytes_skipped, gc->bytes_typed,
+                total_time, c->steps, c->max_pause_us,
+                (c->setup_us/total_time)*100,
+                (c->mark_us/total_time)*100,
+                (c->sweep_us/total_time)*100);
+    } else {
+        fprintf(stderr, "GC: %zu->%zu allocs, %zu->%zu bytes (freed %zu/%zu), scanned %zu bytes (skipped %zu atomic, %zu typed), %.0fus (setup:%.1f%% mark:%.1f%% sweep:%.1f%%)\n",
+                c->old_count, gc->alloc_count + gc->page_object_count,
+                c->old_bytes, gc->allocated_bytes,
+                c->freed_count, c->freed_bytes,
+                gc->bytes_scanned, gc->bytes_skipped, gc->bytes_typed,
+                total_time,
+                (c->setup_us/total_time)*100,
+                (c->mark_us/total_time)*100,
+                (c->sweep_us/total_time)*100);
+    }
+}
+
+// Advance the current cycle until it completes or budget_us has elapsed
+// (a negative budget means run to completion). Other threads are stopped
+// while marking; setup and sweep only touch the table and pages that they
+// can't reach without the lock.
+static void run_cycle(gc_state *gc, double budget_us) {
+    gc_cycle *c = &gc->cycle;
+    double start = get_time_us(), phase_start = start, now = start;
+    gc_phase phase = c->phase, entry_phase = c->phase;
+    if (c->phase == GC_PHASE_MARK) stop_world(gc);
+    
+    while (c->phase != GC_PHASE_IDLE) {
+        switch (c->phase) {
+        case GC_PHASE_SETUP:
+            if (setup_unit(gc)) {
+                stop_world(gc);
+                begin_mark(gc);
+            }
+            break;
+        case GC_PHASE_MARK:
+            // finish_mark drains whatever is left in one go
+            if (!(c->dirty_tracking && budget_us >= 0) || drain_mark_stack(gc, GC_STEP_RANGES)) {
+                finish_mark(gc);
+                resume_world(gc);
+            }
+            break;
+        case GC_PHASE_SWEEP:
+            if (sweep_unit(gc)) finish_sweep(gc);
+            break;
+        case GC_PHASE_IDLE:
+            break;
+        }
+        now = get_time_us();
+        if (c->phase != phase) {
+            // Attribute time to the phase that just ended
+            double spent = now - phase_start;
+            if (phase == GC_PHASE_SETUP) c->setup_us += spent;
+            else if (phase == GC_PHASE_MARK) c->mark_us += spent;
+            else if (phase == GC_PHASE_SWEEP) c->sweep_us += spent;
+            phase_start = now;
+            phase = c->phase;
+        }
+        // Without dirty bits marking can't be interrupted safely
+        if (c->phase == GC_PHASE_MARK && !c->dirty_tracking) continue;
+        // Marking is done, the sweeper takes it from here
+        if (c->phase == GC_PHASE_SWEEP && entry_phase != GC_PHASE_SWEEP && c->background_sweep) {
+            pthread_cond_signal(&gc->sweep_wake);
+            break;
+        }
+        if (budget_us >= 0 && now - start >= budget_us) break;
+    }
+    
+    double spent = now - phase_start;
+    if (phase == GC_PHASE_SETUP) c->setup_us += spent;
+    else if (phase == GC_PHASE_MARK) c->mark_us += spent;
+    else if (phase == GC_PHASE_SWEEP) c->sweep_us += spent;
+    
+    if (c->phase == GC_PHASE_MARK) {
+        resume_world(gc);
+        c->mutator_ran = true;
+    }
+    c->steps++;
+    if (now - start > c->max_pause_us) c->max_pause_us = now - start;
+    // The sweeper runs alongside the program, its slices are not pauses
+    if (!gc->sweep_batch) note_pause(gc, now - start);
+    if (c->phase == GC_PHASE_IDLE) {
+        adjust_threshold(gc, now);
+        if (gc->debug_print_stats) print_cycle_stats(gc);
+        if (gc->rss_target) trim_memory(gc);
+    }
+}
+
+// Put the table back in order when a cycle is dropped part way (at cleanup)
+static void abandon_cycle(gc_state *gc) {
+    gc_cycle *c = &gc->cycle;
+    if (c->phase == GC_PHASE_IDLE) return;
+    if (c->phase == GC_PHASE_SETUP) {
+        // Entries may be split between the table and the merge buffer
+        while (!setup_unit(gc)) {}
+    }
+    gc->sorted_count = c->count;
+    if (c->phase == GC_PHASE_SWEEP) {
+        // Entries between the compaction cursor and the sweep position were freed or moved
+        memmove(gc->allocs + c->sweep_write, gc->allocs + c->pos, (gc->alloc_count - c->pos) * sizeof(gc_entry));
+        gc->alloc_count -= c->pos - c->sweep_write;
+        gc->sorted_count -= c->pos - c->sweep_write;
+        memset(gc->cache, 0, gc->cache_size * sizeof(gc_entry*));
+    }
+    for (size_t i = 0; i < gc->alloc_count; i++)
+        entry_set_marked(&gc->allocs[i], 0);
+    free(c->tmp);
+    memset(c, 0, sizeof(*c));
+}
+
+// ---- Background sweeping ---------------------------------------------------
+
+// The sweeper sleeps on sweep_wake until run_cycle hands it a cycle that
+// finished marking, then sweeps in slices of GC_SWEEP_SLICE_US so the
+// program's threads get the lock in between. Dead table entries are only
+// unlinked under the lock, their blocks are queued in sweep_batch and go
+// back to malloc after the sweeper lets go of it.
+
+static void* sweeper_main(void *arg) {
+    gc_state *gc = (gc_state*)arg;
+    gc_cycle *c = &gc->cycle;
+    void **batch = (void**)malloc(GC_SWEEP_BATCH * sizeof(void*));
+    pthread_mutex_lock(&gc->lock);
+    for (;;) {
+        while (!gc->sweeper_quit && !(c->phase == GC_PHASE_SWEEP && c->background_sweep))
+            pthread_cond_wait(&gc->sweep_wake, &gc->lock);
+        if (gc->sweeper_quit) break;
+        gc->sweep_batch = batch;
+        gc->sweep_batch_count = 0;
+        run_cycle(gc, GC_SWEEP_SLICE_US);
+        size_t n = gc->sweep_batch_count;
+        gc->sweep_batch = NULL;
+        pthread_mutex_unlock(&gc->lock);
+        for (size_t i = 0; i < n; i++)
+            free(batch[i]);
+        sched_yield();
+        pthread_mutex_lock(&gc->lock);
+    }
+    pthread_mutex_unlock(&gc->lock);
+    free(batch);
+    return NULL;
+}
+
+// Start the sweeper when background sweeping is first wanted, before a
+// cycle begins (this allocates)
+static void start_sweeper(gc_state *gc) {
+    if (gc->sweeper_started || !gc->background_sweep) return;
+    sigset_t old_mask;
+    block_async_signals(&old_mask);
+    gc->sweeper_started = pthread_create(&gc->sweeper, NULL, sweeper_main, gc) == 0;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+static void stop_sweeper(gc_state *gc) {
+    if (!gc->sweeper_started) return;
+    pthread_mutex_lock(&gc->lock);
+    gc->sweeper_quit = true;
+    pthread_cond_signal(&gc->sweep_wake);
+    pthread_mutex_unlock(&gc->lock);
+    pthread_join(gc->sweeper, NULL);
+    gc->sweeper_started = false;
+    gc->sweeper_quit = false;
+}
+
+// ---- Explicit release ------------------------------------------------------
+
+// gc_free and gc_realloc look objects up by their exact start. Outside a
+// cycle the table is a sorted prefix plus recent appends. While a cycle is
+// running, entries may be mid-merge or mid-compaction, so apart from the
+// sorted table during marking the search is linear. Stale copies left
+// behind by setup and sweep are exact duplicates of live entries, and newer
+// entries are found before them.
+
+static gc_entry* lookup_entry(gc_state *gc, void *ptr) {
+    gc_cycle *c = &gc->cycle;
+    size_t sorted = c->phase == GC_PHASE_IDLE ? gc->sorted_count :
+                    c->phase == GC_PHASE_MARK ? c->count : 0;
+    // Recent allocations first, they are what growth paths hand back
+    for (size_t i = gc->alloc_count; i > sorted; i--) {
+        if (entry_ptr(&gc->allocs[i - 1]) == ptr) return &gc->allocs[i - 1];
+    }
+    gc_entry *e = (gc_entry*)bsearch(&ptr, gc->allocs, sorted, sizeof(gc_entry), find_entry_compare);
+    if (e && entry_ptr(e) == ptr) return e;
+    // Setup may hold new entries only in its merge buffer
+    if (c->phase == GC_PHASE_SETUP && c->tmp) {
+        for (size_t i = 0; i < c->count - gc->sorted_count; i++) {
+            if (entry_ptr(&c->tmp[i]) == ptr) return &c->tmp[i];
+        }
+    }
+    return NULL;
+}
+
+// Size that ptr can grow to without moving
+static size_t page_object_capacity(gc_page *p) {
+    if (p->size_class == GC_LARGE_CLASS) return large_mapping_size(p->size) - GC_PAGE_FIRST;
+    return p->size;
+}
+
+// Grow a large object's mapping without moving it, when the address space
+// after it is free
+static bool grow_large(gc_state *gc, gc_page *p, size_t size) {
+    size_t old_len = large_mapping_size(p->size), len = large_mapping_size(size);
+    if (len > old_len) {
+        if (mremap(p, old_len, len, 0) == MAP_FAILED) return false;
+        for (size_t off = old_len & ~(size_t)(GC_PAGE_SIZE - 1); off < len; off += GC_PAGE_SIZE)
+            page_map_set(gc, (gc_page*)((char*)p + off), p);
+        widen_page_bounds(gc, (char*)p, (char*)p + len);
+        filter_add(gc, p, len);
+    }
+    // Marked objects are old, unmarked ones still count toward the nursery
+    if (!bit_test(p->mark_bits, 0)) gc->young_bytes += size - p->size;
+    gc->allocated_bytes += size - p->size;
+    p->size = size;
+    return true;
+}
+
+static void free_page_object(gc_state *gc, gc_page *p, size_t slot) {
+    size_t w = slot / 64;
+    uint64_t bit = (uint64_t)1 << (slot % 64);
+    if (!(p->mark_bits[w] & bit)) {
+        size_t young = p->size < gc->young_bytes ? p->size : gc->young_bytes;
+        gc->young_bytes -= young;
+    }
+    p->alloc_bits[w] &= ~bit;
+    p->mark_bits[w] &= ~bit;
+    p->atomic_bits[w] &= ~bit;
+    p->typed_bits[w] &= ~bit;
+    p->live--;
+    p->exhausted = false;
+    gc->allocated_bytes -= p->size;
+    gc->page_object_count--;
+    
+    // An empty large object's mapping is unmapped by the next sweep, its
+    // memory can go back right away
+    if (p->size_class == GC_LARGE_CLASS) {
+        size_t os_page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t keep = (GC_PAGE_FIRST + os_page - 1) & ~(os_page - 1);
+        size_t len = large_mapping_size(p->size);
+        if (len > keep) madvise((char*)p + keep, len - keep, MADV_DONTNEED);
+    }
+}
+
+// ---- Heap profile ----------------------------------------------------------
+
+// Sites live in an array, so objects can refer to them by index, with an
+// open addressing hash from address to index beside it. Tracked objects
+// are an open addressing hash keyed by address, with linear probing and
+// backward shift deletion. Everything here runs with the lock held.
+
+static inline size_t profile_hash(const void *ptr, size_t capacity) {
+    return (size_t)(((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ull) & (capacity - 1);
+}
+
+static uint32_t profile_site_of(gc_state *gc, const void *site) {
+    size_t cap = gc->profile_site_capacity;
+    if (cap) {
+        for (size_t i = profile_hash(site, cap * 2);; i = (i + 1) & (cap * 2 - 1)) {
+            uint32_t k = gc->profile_site_index[i];
+            if (!k) break;
+            if (gc->profile_sites[k - 1].site == site) return k - 1;
+        }
+    }
+    if (gc->profile_site_count >= cap) {
+        // Grow the array and rehash the index at twice its size
+        size_t n = cap ? cap * 2 : 256;
+        gc_profile_site *ns = (gc_profile_site*)realloc(gc->profile_sites, n * sizeof(gc_profile_site));
+        uint32_t *ni = (uint32_t*)calloc(n * 2, sizeof(uint32_t));
+        if (!ns || !ni) { fprintf(stderr, "gc_malloc: OOM (profile sites)\n"); exit(1); }
+        for (size_t k = 0; k < gc->profile_site_count; k++) {
+            size_t i = profile_hash(ns[k].site, n * 2);
+            while (ni[i]) i = (i + 1) & (n * 2 - 1);
+            ni[i] = (uint32_t)k + 1;
+        }
+        free(gc->profile_site_index);
+        gc->profile_sites = ns;
+        gc->profile_site_index = ni;
+        gc->profile_site_capacity = cap = n;
+    }
+    uint32_t k = (uint32_t)gc->profile_site_count++;
+    gc->profile_sites[k] = (gc_profile_site){ .site = site };
+    size_t i = profile_hash(site, cap * 2);
+    while (gc->profile_site_index[i]) i = (i + 1) & (cap * 2 - 1);
+    gc->profile_site_index[i] = k + 1;
+    return k;
+}
+
+static gc_profile_object* profile_find(gc_state *gc, const void *ptr) {
+    if (!gc->profile_objects) return NULL;
+    size_t mask = gc->profile_object_capacity - 1;
+    for (size_t i = profile_hash(ptr, mask + 1);; i = (i + 1) & mask) {
+        gc_profile_object *o = &gc->profile_objects[i];
+        if (!o->ptr) return NULL;
+        if (o->ptr == ptr) return o;
+    }
+}
+
+// Empty slot for ptr, which is not in the hash
+static gc_profile_object* profile_slot(gc_state *gc, const void *ptr) {
+    size_t mask = gc->profile_object_capacity - 1;
+    size_t i = profile_hash(ptr, mask + 1);
+    while (gc->profile_objects[i].ptr) i = (i + 1) & mask;
+    return &gc->profile_objects[i];
+}
+
+// Close the gap left at o by moving up entries that probed past it
+static void profile_remove(gc_state *gc, gc_profile_object *o) {
+    size_t mask = gc->profile_object_capacity - 1;
+    size_t hole = (size_t)(o - gc->profile_objects);
+    for (size_t i = (hole + 1) & mask; gc->profile_objects[i].ptr; i = (i + 1) & mask) {
+        size_t home = profile_hash(gc->profile_objects[i].ptr, mask + 1);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            gc->profile_objects[hole] = gc->profile_objects[i];
+            hole = i;
+        }
+    }
+    gc->profile_objects[hole].ptr = NULL;
+    gc->profile_object_count--;
+}
+
+// Objects a record stands for: a sample weighs the bytes allocated since
+// the one before, spread over allocations of its size
+static inline size_t profile_count(const gc_profile_object *o) {
+    return o->weight > o->size ? o->weight / (o->size ? o->size : 1) : 1;
+}
+
+static void profile_retire(gc_state *gc, gc_profile_object *o, double now) {
+    gc_profile_site *s = &gc->profile_sites[o->site];
+    size_t count = profile_count(o);
+    s->live_bytes -= o->weight;
+    s->deaths += count;
+    s->lifetime_us += (now - o->birth_us) * count;
+}
+
+static gc_profile_object profile_record(gc_state *gc, void *ptr, size_t size, size_t weight,
+                                        const void *site, double now) {
+    uint32_t k = profile_site_of(gc, site);
+    gc_profile_object o = { .ptr = ptr, .size = size, .weight = weight, .birth_us = now, .site = k };
+    gc_profile_site *s = &gc->profile_sites[k];
+    s->allocs += profile_count(&o);
+    s->bytes += weight;
+    s->live_bytes += weight;
+    return o;
+}
+
+static void profile_alloc(gc_state *gc, void *ptr, size_t size, size_t weight, const void *site,
+                          gc_region *region) {
+    double now = get_time_us();
+    if (region) {
+        // Retired together when the region ends
+        if (region->profile_count >= region->profile_capacity) {
+            size_t n = region->profile_capacity ? region->profile_capacity * 2 : 16;
+            gc_profile_object *np = (gc_profile_object*)realloc(region->profile, n * sizeof(gc_profile_object));
+            if (!np) { fprintf(stderr, "gc_malloc: OOM (profile objects)\n"); exit(1); }
+            region->profile = np;
+            region->profile_capacity = n;
+        }
+        region->profile[region->profile_count++] = profile_record(gc, ptr, size, weight, site, now);
+        return;
+    }
+    
+    // The address was handed out again, whatever had it is dead
+    gc_profile_object *o = profile_find(gc, ptr);
+    if (o) {
+        profile_retire(gc, o, now);
+        profile_remove(gc, o);
+    }
+    
+    if ((gc->profile_object_count + 1) * 2 > gc->profile_object_capacity) {
+        gc_profile_object *old = gc->profile_objects;
+        size_t old_cap = gc->profile_object_capacity;
+        size_t n = old_cap ? old_cap * 2 : GC_PROFILE_INITIAL;
+        gc->profile_objects = (gc_profile_object*)calloc(n, sizeof(gc_profile_object));
+        if (!gc->profile_objects) { fprintf(stderr, "gc_malloc: OOM (profile objects)\n"); exit(1); }
+        gc->profile_object_capacity = n;
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i].ptr) *profile_slot(gc, old[i].ptr) = old[i];
+        free(old);
+    }
+    *profile_slot(gc, ptr) = profile_record(gc, ptr, size, weight, site, now);
+    gc->profile_object_count++;
+}
+
+// The record of a sampled object, in its region's list or the heap's hash
+static gc_profile_object* profile_lookup(gc_state *gc, gc_region *region, const void *ptr) {
+    if (!region) return profile_find(gc, ptr);
+    // Only a region's last object can be freed, search from the end
+    for (size_t i = region->profile_count; i-- > 0;)
+        if (region->profile[i].ptr == ptr) return &region->profile[i];
+    return NULL;
+}
+
+static void profile_free(gc_state *gc, gc_region *region, void *ptr) {
+    gc_profile_object *o = profile_lookup(gc, region, ptr);
+    if (!o) return;
+    profile_retire(gc, o, get_time_us());
+    if (region) *o = region->profile[--region->profile_count];
+    else profile_remove(gc, o);
+}
+
+// Retire the samples of a region that is being released
+static void profile_release_region(gc_state *gc, gc_region *region) {
+    double now = get_time_us();
+    for (size_t i = 0; i < region->profile_count; i++)
+        profile_retire(gc, &region->profile[i], now);
+    free(region->profile);
+}
+
+// Follow an object compaction moved
+static void profile_move(gc_state *gc, void *from, void *to) {
+    gc_profile_object *o = profile_find(gc, from);
+    if (!o) return;
+    gc_profile_object moved = *o;
+    profile_remove(gc, o);
+    moved.ptr = to;
+    *profile_slot(gc, to) = moved;
+    gc->profile_object_count++;
+}
+
+// Is ptr still the start of a heap object, right after a sweep
+static bool profile_alive(gc_state *gc, void *ptr) {
+    gc_page *p = find_page(gc, ptr);
+    if (p) {
+        size_t slot = page_find_slot(p, ptr);
+        return slot != SIZE_MAX && page_object_start(p, slot) == (char*)ptr;
+    }
+    return lookup_entry(gc, ptr) != NULL;
+}
+
+// Retire the sampled heap objects a collection found dead, the others
+// survived it if it was a full one. A removal can shift a later entry into
+// the current slot, so the slot is looked at again.
+static void profile_scan(gc_state *gc, bool full) {
+    double now = get_time_us();
+    for (size_t i = 0; i < gc->profile_object_capacity;) {
+        gc_profile_object *o = &gc->profile_objects[i];
+        if (o->ptr && !profile_alive(gc, o->ptr)) {
+            profile_retire(gc, o, now);
+            profile_remove(gc, o);
+            continue;
+        }
+        if (full && o->ptr && !o->survived) {
+            o->survived = true;
+            gc->profile_sites[o->site].survived_bytes += o->weight;
+        }
+        i++;
+    }
+}
+
+// Interval to the next sample, uniform over 1 to twice profile_sample so
+// allocation patterns that repeat at the sampling period are not always
+// caught at the same point (xorshift64)
+static size_t profile_interval(gc_state *gc, gc_thread *t) {
+    uint64_t x = t->profile_rng ? t->profile_rng : ((uintptr_t)t | 1) * 0x9E3779B97F4A7C15ull;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    t->profile_rng = x;
+    return 1 + (size_t)(x % (2 * gc->profile_sample));
+}
+
+// Charge an allocation the program just got, to the wrapper's caller if
+// one is running. Only one allocation per profile_sample bytes on average
+// is recorded, standing for all the bytes since the previous one, and the
+// rest cost a per-thread counter.
+static void profile_note(gc_state *gc, gc_thread *t, void *ptr, size_t size, const void *site, gc_region *region) {
+    size_t weight = size;
+    if (gc->profile_sample) {
+        if (!t->profile_next) t->profile_next = profile_interval(gc, t);
+        t->profile_pending += size;
+        if (t->profile_pending < t->profile_next) return;
+        weight = t->profile_pending;
+        t->profile_pending = 0;
+        t->profile_next = profile_interval(gc, t);
+    }
+    pthread_mutex_lock(&gc->lock);
+    profile_alloc(gc, ptr, size, weight, t->profile_site ? t->profile_site : site, region);
+    pthread_mutex_unlock(&gc->lock);
+}
+
+static int profile_compare(const void *a, const void *b) {
+    size_t x = ((const gc_profile_site*)a)->bytes, y = ((const gc_profile_site*)b)->bytes;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Code address as module+offset, plus the symbol when it is exported
+static void profile_print_site(FILE *out, const void *site) {
+    Dl_info info;
+    if (!dladdr(site, &info) || !info.dli_fname) {
+        fprintf(out, "%p", site);
+        return;
+    }
+    const char *name = strrchr(info.dli_fname, '/');
+    name = name ? name + 1 : info.dli_fname;
+    fprintf(out, "%s+0x%zx", name, (size_t)((const char*)site - (const char*)info.dli_fbase));
+    if (info.dli_sname)
+        fprintf(out, " (%s+0x%zx)", info.dli_sname, (size_t)((const char*)site - (const char*)info.dli_saddr));
+}
+
+// ---- Public API ------------------------------------------------------------
+
+void gc_init(gc_state *gc, void *stack_bottom) {
+    gc->alloc_capacity = GC_INITIAL_ALLOC_SIZE;
+    gc->allocs = (gc_entry*)malloc(gc->alloc_capacity * sizeof(gc_entry));
+    if (!gc->allocs) { fprintf(stderr, "gc_init: OOM\n"); exit(1); }
+    gc->alloc_count = 0;
+    gc->sorted_count = 0;
+    gc->allocated_bytes = 0;
+    gc->threshold = DEFAULT_GC_THRESHOLD;
+    gc->defer_depth = 0;
+    gc->weak_refs = NULL;
+    gc->weak_count = gc->weak_capacity = 0;
+    gc->rss_target = 0;  // Default: memory kept for reuse stays resident
+    gc->compact = false;  // Default: objects never move
+    gc->pressure_limit = 0;  // Default: no pressure callbacks
+    gc->pressure_next = 0;
+    gc->pressure_callbacks = NULL;
+    gc->pressure_count = gc->pressure_capacity = 0;
+    gc->target_pause_us = 0;  // Default: threshold doubles as the heap grows
+    gc->target_gc_share = 0;
+    gc->mark_cost_us = gc->heap_cost_us = gc->pause_heap_cost_us = 0;
+    gc->alloc_rate = 0;
+    gc->last_cycle_end_us = 0;
+    gc->last_live_bytes = 0;
+    gc->idle_base_bytes = 0;
+    gc->stack_bottom = stack_bottom;
+
+    // Initialize cache with minimal size
+    gc->cache_size = 16;  // Minimum cache size
+    gc->cache_mask = gc->cache_size - 1;
+    gc->cache = (gc_entry**)calloc(gc->cache_size, sizeof(gc_entry*));
+    if (!gc->cache) { fprintf(stderr, "gc_init: OOM (cache)\n"); exit(1); }
+
+    gc->root_capacity = GC_INITIAL_ROOTS;
+    gc->roots = (gc_root*)malloc(gc->root_capacity * sizeof(gc_root));
+    if (!gc->roots) { fprintf(stderr, "gc_init: OOM (roots)\n"); exit(1); }
+    gc->root_count = 0;
+    
+    gc->mark_stack = NULL;
+    gc->mark_stack_capacity = 0;
+    if (!resize_mark_stack(gc, GC_INITIAL_MARK_STACK)) { fprintf(stderr, "gc_init: OOM (mark stack)\n"); exit(1); }
+    gc->mark_stack_size = 0;
+    gc->heap_min = gc->heap_max = NULL;
+    gc->scan_filter = (uint64_t*)calloc(GC_FILTER_BITS / 64, sizeof(uint64_t));
+    if (!gc->scan_filter) { fprintf(stderr, "gc_init: OOM (scan filter)\n"); exit(1); }
+    pick_filter();
+    
+    gc->page_map = (gc_page***)calloc(GC_PAGE_MAP_SIZE, sizeof(gc_page**));
+    if (!gc->page_map) { fprintf(stderr, "gc_init: OOM (page map)\n"); exit(1); }
+    gc->page_capacity = GC_INITIAL_PAGES;
+    gc->pages = (gc_page**)malloc(gc->page_capacity * sizeof(gc_page*));
+    if (!gc->pages) { fprintf(stderr, "gc_init: OOM (pages)\n"); exit(1); }
+    gc->page_count = 0;
+    for (size_t cls = 0; cls < GC_SIZE_CLASSES; cls++)
+        gc->class_pages[cls] = NULL;
+    gc->free_pages = NULL;
+    gc->free_page_count = 0;
+    gc->arenas = NULL;
+    gc->arena_count = gc->arena_capacity = 0;
+    gc->arena_next = gc->arena_end = NULL;
+    gc->page_min = gc->page_max = NULL;
+    gc->page_object_count = 0;
+    gc->young_bytes = 0;
+    gc->nursery_size = GC_NURSERY_SIZE;
+    gc->minor_count = 0;
+    gc->major_count = 0;
+    gc->remembered_clean = false;
+    
+    memset(&gc->cycle, 0, sizeof(gc->cycle));
+    gc->cycle.phase = GC_PHASE_IDLE;
+    gc->incremental_step_us = 0;  // Default: stop-the-world collection
+    gc->alloc_since_step = 0;
+    
+    gc->vdb_checked = false;
+    gc->vdb_pagemap_fd = gc->vdb_clear_refs_fd = -1;
+    gc->vdb_window = NULL;
+    gc->vdb_window_first = 0;
+    gc->vdb_window_len = 0;
+    
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&gc->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    gc->threads = NULL;
+    gc->thread_count = 0;
+    gc->world_stopped = 0;
+    gc->resume_count = 0;
+    sem_init(&gc->suspend_ack, 0, 0);
+    gc->signals_installed = false;
+    
+    gc->mark_threads = 0;  // Default: serial marking
+    gc->mark_workers = NULL;
+    gc->mark_helpers = 0;
+    pthread_mutex_init(&gc->mark_lock, NULL);
+    pthread_cond_init(&gc->mark_wake, NULL);
+    pthread_cond_init(&gc->mark_done, NULL);
+    gc->mark_round = 0;
+    gc->mark_finished = 0;
+    gc->mark_quit = false;
+    gc->mark_active = 0;
+    
+    gc->background_sweep = false;  // Default: sweep on the collecting thread
+    gc->sweeper_started = false;
+    gc->sweeper_quit = false;
+    pthread_cond_init(&gc->sweep_wake, NULL);
+    gc->sweep_batch = NULL;
+    gc->sweep_batch_count = 0;
+    
+    gc->region_spare = NULL;
+    gc->region_spare_count = 0;
+    gc->region_bytes = 0;
+    
+    gc->profile = false;  // Default: no heap profile
+    gc->profile_sample = GC_PROFILE_SAMPLE;
+    gc->profile_sites = NULL;
+    gc->profile_site_count = gc->profile_site_capacity = 0;
+    gc->profile_site_index = NULL;
+    gc->profile_objects = NULL;
+    gc->profile_object_count = gc->profile_object_capacity = 0;
+    
+    gc->debug_stress = 0;  // Default: stress testing disabled
+    gc->debug_print_stats = 0;  // Default: stats printing disabled
+    gc->typed_scan = true;
+    gc->bytes_scanned = 0;
+    gc->bytes_skipped = 0;
+    gc->bytes_typed = 0;
+    memset(&gc->stats, 0, sizeof(gc->stats));
+    
+    gc_register_thread(gc, stack_bottom);
+}
+
+void gc_register_thread(gc_state *gc, void *stack_bottom) {
+    gc_thread *t = (gc_thread*)calloc(1, sizeof(gc_thread));
+    if (!t) { fprintf(stderr, "gc_register_thread: OOM\n"); exit(1); }
+    t->gc = gc;
+    t->id = pthread_self();
+    t->stack_bottom = stack_bottom;
+    pthread_mutex_lock(&gc->lock);
+    if (gc->thread_count > 0) install_signal_handlers(gc);
+    t->next = gc->threads;
+    gc->threads = t;
+    gc->thread_count++;
+    gc_current_thread = t;
+    pthread_mutex_unlock(&gc->lock);
+}
+
+void gc_unregister_thread(gc_state *gc) {
+    gc_thread *t = current_thread(gc, "gc_unregister_thread");
+    pthread_mutex_lock(&gc->lock);
+    flush_thread(gc, t);
+    release_tlab(t);
+    release_regions(gc, t);
+    for (gc_thread **link = &gc->threads; *link; link = &(*link)->next) {
+        if (*link == t) { *link = t->next; break; }
+    }
+    gc->thread_count--;
+    restore_signal_handlers(gc);
+    gc_current_thread = NULL;
+    pthread_mutex_unlock(&gc->lock);
+    free(t);
+}
+
+void gc_cleanup(gc_state *gc) {
+    stop_sweeper(gc);
+    pthread_cond_destroy(&gc->sweep_wake);
+    abandon_cycle(gc);
+    stop_mark_helpers(gc);
+    pthread_cond_destroy(&gc->mark_wake);
+    pthread_cond_destroy(&gc->mark_done);
+    pthread_mutex_destroy(&gc->mark_lock);
+    for (size_t i = 0; i < gc->alloc_count; i++)
+        free(entry_ptr(&gc->allocs[i]));
+    free(gc->allocs); gc->allocs = NULL; gc->alloc_capacity = 0;
+    gc->alloc_count = 0; gc->sorted_count = 0; gc->allocated_bytes = 0;
+    free(gc->cache); gc->cache = NULL;
+    free(gc->roots); gc->roots = NULL; gc->root_count = 0; gc->root_capacity = 0;
+    munmap(gc->mark_stack, gc->mark_stack_capacity * sizeof(gc_mark_range));
+    gc->mark_stack = NULL; gc->mark_stack_size = 0; gc->mark_stack_capacity = 0;
+    for (size_t i = 0; i < gc->page_count; i++)
+        if (gc->pages[i]->size_class == GC_LARGE_CLASS) unmap_large(gc, gc->pages[i]);
+    for (size_t i = 0; i < gc->arena_count; i++)
+        munmap(gc->arenas[i], GC_ARENA_SIZE);
+    free(gc->arenas); gc->arenas = NULL; gc->arena_count = gc->arena_capacity = 0;
+    for (size_t i = 0; i < GC_PAGE_MAP_SIZE; i++)
+        free(gc->page_map[i]);
+    free(gc->page_map); gc->page_map = NULL;
+    free(gc->pages); gc->pages = NULL; gc->page_count = 0; gc->page_capacity = 0;
+    free(gc->scan_filter); gc->scan_filter = NULL;
+    for (size_t cls = 0; cls < GC_SIZE_CLASSES; cls++)
+        gc->class_pages[cls] = NULL;
+    gc->free_pages = NULL; gc->free_page_count = 0;
+    gc->arena_next = gc->arena_end = NULL; gc->page_object_count = 0;
+    vdb_disable(gc);
+    free(gc->vdb_window); gc->vdb_window = NULL;
+    // Threads still registered lose their records
+    while (gc->threads) {
+        gc_thread *t = gc->threads;
+        gc->threads = t->next;
+        release_regions(gc, t);
+        if (t == gc_current_thread) gc_current_thread = NULL;
+        free(t);
+    }
+    gc->thread_count = 0;
+    restore_signal_handlers(gc);
+    while (gc->region_spare) {
+        gc_region_chunk *c = gc->region_spare;
+        gc->region_spare = c->next;
+        munmap(c, GC_REGION_CHUNK);
+    }
+    gc->region_spare_count = 0;
+    free(gc->weak_refs); gc->weak_refs = NULL;
+    gc->weak_count = gc->weak_capacity = 0;
+    free(gc->pressure_callbacks); gc->pressure_callbacks = NULL;
+    gc->pressure_count = gc->pressure_capacity = 0;
+    free(gc->profile_sites); gc->profile_sites = NULL;
+    free(gc->profile_site_index); gc->profile_site_index = NULL;
+    gc->profile_site_count = gc->profile_site_capacity = 0;
+    free(gc->profile_objects); gc->profile_objects = NULL;
+    gc->profile_object_count = gc->profile_object_capacity = 0;
+    sem_destroy(&gc->suspend_ack);
+    pthread_mutex_destroy(&gc->lock);
+}
+
+// Full collection with the lock held. A new cycle leaves its sweep to the
+// sweeper unless wait is set, a cycle already in progress is finished here,
+// sweep included.
+static void collect_locked(gc_state *gc, bool wait) {
+    if (gc->cycle.phase == GC_PHASE_IDLE) {
+        start_sweeper(gc);
+        begin_cycle(gc, false);
+        if (wait) gc->cycle.background_sweep = false;
+    } else {
+        gc->cycle.background_sweep = false;
+    }
+    run_cycle(gc, -1);
+}
+
+void gc_collect(gc_state *gc) {
+    current_thread(gc, "gc_collect");
+    pthread_mutex_lock(&gc->lock);
+    collect_locked(gc, false);
+    pthread_mutex_unlock(&gc->lock);
+}
+
+// The whole minor collection runs with the other threads stopped, the
+// lock-free allocation path stays open outside full cycles
+static void collect_minor(gc_state *gc) {
+    // A full cycle in progress will sweep the nursery itself
+    if (gc->cycle.phase != GC_PHASE_IDLE) return;
+    
+    // These allocate, do them before the other threads are stopped
+    bool vdb = vdb_wanted(gc) && vdb_available(gc);
+    start_mark_helpers(gc);
+    stop_world(gc);
+    double start_time = get_time_us();
+    size_t old_bytes = gc->allocated_bytes;
+    size_t young_bytes = gc->young_bytes;
+    note_peak(gc);
+    size_t freed_count = 0, freed_bytes = 0;
+    gc->bytes_scanned = 0;
+    gc->bytes_skipped = 0;
+    gc->bytes_typed = 0;
+    
+    // Only young page objects are looked up, the table isn't searched
+    // outside a full cycle
+    gc->heap_min = gc->page_min;
+    gc->heap_max = gc->page_max;
+    
+    // Remembered set: old objects that may have been given pointers to young
+    // ones since the last collection. Without a clean set of dirty bits that
+    // means every old object that can hold pointers.
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    bool dirty_only = gc->remembered_clean;
+    for (size_t i = 0; i < gc->alloc_count; i++) {
+        gc_entry *e = &gc->allocs[i];
+        if (entry_atomic(e)) continue;
+        char *p = entry_ptr(e);
+        if (dirty_only) rescan_if_dirty(gc, p, p + e->size, page_size);
+        else mark_stack_push(gc, p, p + e->size);
+    }
+    push_marked_page_objects(gc, dirty_only, page_size);
+    
+    scan_roots(gc, scan_range_for_ptrs);
+    mark_all(gc);
+    shrink_mark_stack(gc);
+    clear_weak_refs(gc, true);
+    
+    // Unreached young objects are freed, the survivors stay marked and are
+    // old from now on
+    for (size_t i = 0; i < gc->page_count; i++)
+        sweep_page(gc, gc->pages[i], &freed_count, &freed_bytes);
+    release_empty_pages(gc);
+    // Few enough samples to check each time, before their slots are reused
+    if (gc->profile) profile_scan(gc, false);
+    gc->minor_count++;
+    gc->idle_base_bytes = gc->allocated_bytes;
+    gc->remembered_clean = vdb && vdb_clear(gc);
+    
+    // A minor collection costs about what it scans, mostly the remembered
+    // set. Letting the nursery grow to match keeps that cost proportional
+    // to allocation when the old space is big and can't be filtered.
+    gc->nursery_size = gc->bytes_scanned > GC_NURSERY_SIZE ? gc->bytes_scanned : GC_NURSERY_SIZE;
+    resume_world(gc);
+    double end_time = get_time_us();
+    note_pause(gc, end_time - start_time);
+    gc->stats.bytes_scanned += gc->bytes_scanned;
+    gc->stats.freed_objects += freed_count;
+    gc->stats.freed_bytes += freed_bytes;
+    
+    if (gc->debug_print_stats) {
+        fprintf(stderr, "GC minor: %zu->%zu bytes (freed %zu/%zu young, promoted %zu), scanned %zu bytes (skipped %zu atomic, %zu typed), %.0fus\n",
+                old_bytes, gc->allocated_bytes,
+                freed_count, freed_bytes, young_bytes - freed_bytes,
+                gc->bytes_scanned, gc->bytes_skipped, gc->bytes_typed,
+                end_time - start_time);
+    }
+}
+
+void gc_collect_minor(gc_state *gc) {
+    current_thread(gc, "gc_collect_minor");
+    pthread_mutex_lock(&gc->lock);
+    collect_minor(gc);
+    pthread_mutex_unlock(&gc->lock);
+}
+
+bool gc_idle(gc_state *gc) {
+    gc_thread *t = current_thread(gc, "gc_idle");
+    pthread_mutex_lock(&gc->lock);
+    flush_thread(gc, t);
+    gc_cycle *c = &gc->cycle;
+    bool worked = true;
+    if (gc->defer_depth) {
+        worked = false;
+    } else if (c->phase != GC_PHASE_IDLE) {
+        // Finish the cycle, unless only the sweeper's part is left
+        if (c->phase == GC_PHASE_SWEEP && c->background_sweep) worked = false;
+        else collect_locked(gc, false);
+    } else if (gc->young_bytes == 0 && gc->allocated_bytes <= gc->idle_base_bytes) {
+        worked = false;  // Nothing allocated since the last collection
+    } else if (gc->allocated_bytes - gc->young_bytes >= gc->idle_base_bytes + gc->threshold / GC_IDLE_DIVISOR) {
+        // Growth, not size: live data near the threshold would otherwise
+        // bring every call back here to free nothing
+        collect_locked(gc, false);
+    } else if (gc->young_bytes >= gc->nursery_size / GC_IDLE_DIVISOR) {
+        collect_minor(gc);
+    } else {
+        worked = false;
+    }
+    pthread_mutex_unlock(&gc->lock);
+    return worked;
+}
+
+void gc_defer_begin(gc_state *gc) {
+    pthread_mutex_lock(&gc->lock);
+    gc->defer_depth++;
+    pthread_mutex_unlock(&gc->lock);
+}
+
+void gc_defer_end(gc_state *gc) {
+    pthread_mutex_lock(&gc->lock);
+    gc->defer_depth--;
+    pthread_mutex_unlock(&gc->lock);
+}
+
+// Take an incremental step, starting a cycle if none is running
+static void gc_step(gc_state *gc, double budget_us) {
+    gc->alloc_since_step = 0;
+    if (gc->cycle.phase == GC_PHASE_IDLE) {
+        start_sweeper(gc);
+        begin_cycle(gc, true);
+    } else if (gc->cycle.phase == GC_PHASE_SWEEP && gc->cycle.background_sweep) {
+        return;  // The sweeper's job
+    }
+    run_cycle(gc, budget_us);
+}
+
+// Debug stress mode: force collection work before every allocation,
+// alternating minor and full collections
+static void stress_collect(gc_state *gc) {
+    if (gc->incremental_step_us) gc_step(gc, 0);
+    else if (gc->minor_count <= gc->major_count) collect_minor(gc);
+    else gc_collect(gc);
+}
+
+// The heap is close to pressure_limit: let the callbacks drop what they can
+// and collect it
+static void relieve_pressure(gc_state *gc) {
+    // Until the collection says otherwise, a background sweep may take a while
+    gc->pressure_next = gc->allocated_bytes + gc->pressure_limit / 8;
+    for (size_t i = 0; i < gc->pressure_count; i++)
+        gc->pressure_callbacks[i].fn(gc, gc->allocated_bytes, gc->pressure_callbacks[i].data);
+    collect_locked(gc, false);
+}
+
+// Allocation with the lock held. Typed objects get their header in front
+// and never come from malloc, the table has no room for a layout.
+static void* alloc_locked(gc_state *gc, gc_thread *t, size_t size, bool atomic, const gc_layout *layout) {
+    if (layout) size += GC_TYPED_HEADER;
+    flush_thread(gc, t);
+    // Deferred collections wait until the heap is twice past the trigger
+    size_t slack = gc->defer_depth ? 2 : 1;
+    if (gc->pressure_limit) {
+        size_t mark = gc->pressure_next ? gc->pressure_next : gc->pressure_limit - gc->pressure_limit / 8;
+        if (gc->allocated_bytes + size >= mark) relieve_pressure(gc);
+    }
+    if (gc->debug_stress) {
+        stress_collect(gc);
+    } else if (gc->cycle.phase != GC_PHASE_IDLE) {
+        gc->alloc_since_step += size;
+        if (gc->allocated_bytes + size > gc->threshold * 2) {
+            // The program is outrunning the collector, finish the cycle now
+            gc_collect(gc);
+        } else if (!gc->defer_depth && gc->alloc_since_step >= GC_STEP_ALLOC_BYTES) {
+            gc_step(gc, gc->incremental_step_us);
+        }
+    } else if (gc->allocated_bytes - gc->young_bytes + size > gc->threshold * slack) {
+        // Old space (the table and promoted page objects) outgrew the threshold
+        if (gc->incremental_step_us) gc_step(gc, gc->incremental_step_us);
+        else gc_collect(gc);
+    } else if (gc->young_bytes + size > gc->nursery_size * slack) {
+        collect_minor(gc);
+    }
+
+    if (size <= GC_SMALL_MAX) return page_alloc(gc, t, size, atomic, layout);
+    if (size >= GC_LARGE_MIN || layout) return large_alloc(gc, size, atomic, layout);
+
+    void *p = malloc(size);
+    if (!p) { collect_locked(gc, true); p = malloc(size); }
+    if (!p) { fprintf(stderr, "gc_malloc: OOM\n"); exit(1); }
+
+    // Atomic memory is never scanned, so stale bytes in it are harmless
+    if (!atomic) memset(p, 0, size);
+    add_entry(gc, p, size, atomic);
+    
+    // Note: Array becomes unsorted after add, but that's OK.
+    // The next cycle sorts the new tail before any lookups.
+    return p;
+}
+
+// Allocation from the heap, bypassing any region
+static void* heap_alloc(gc_state *gc, gc_thread *t, size_t size, bool atomic, const gc_layout *layout) {
+    // Lock-free path while no cycle is running. A suspend request that
+    // arrives in here waits until the allocation is complete.
+    size_t total = layout ? size + GC_TYPED_HEADER : size;
+    if (total <= GC_SMALL_MAX && !gc->debug_stress) {
+        void *p = NULL;
+        t->in_alloc = 1;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&gc->cycle.phase, __ATOMIC_ACQUIRE) == GC_PHASE_IDLE &&
+            t->pending_bytes < GC_TLAB_BYTES)
+            p = tlab_alloc(t, total, atomic, layout);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        t->in_alloc = 0;
+        if (t->suspend_pending) {
+            t->suspend_pending = 0;
+            suspend_self(t);
+        }
+        if (p) return p;
+    }
+    
+    pthread_mutex_lock(&gc->lock);
+    void *p = alloc_locked(gc, t, size, atomic, layout);
+    pthread_mutex_unlock(&gc->lock);
+    return p;
+}
+
+// site is the public entry point's return address, for the heap profile
+static void* gc_alloc(gc_state *gc, size_t size, bool atomic, const gc_layout *layout, const void *site) {
+    gc_thread *t = current_thread(gc, "gc_malloc");
+    void *p;
+    if (!t->region) {
+        p = heap_alloc(gc, t, size, atomic, layout);
+    } else {
+        if (gc->debug_stress) {
+            pthread_mutex_lock(&gc->lock);
+            stress_collect(gc);
+            pthread_mutex_unlock(&gc->lock);
+        }
+        p = region_alloc(gc, t->region, size, atomic, layout);
+    }
+    if (gc->profile) profile_note(gc, t, p, size, site, t->region);
+    return p;
+}
+
+void* gc_malloc(gc_state *gc, size_t size) {
+    return gc_alloc(gc, size, false, NULL, __builtin_return_address(0));
+}
+
+void* gc_malloc_atomic(gc_state *gc, size_t size) {
+    return gc_alloc(gc, size, true, NULL, __builtin_return_address(0));
+}
+
+void* gc_malloc_typed(gc_state *gc, size_t size, const gc_layout *layout) {
+    if (!layout->size || layout->size % sizeof(void*) || layout->size / sizeof(void*) > 64) {
+        fprintf(stderr, "gc_malloc_typed: bad layout size %zu\n", layout->size);
+        exit(1);
+    }
+    return gc_alloc(gc, size, false, layout, __builtin_return_address(0));
+}
+
+static void free_locked(gc_state *gc, gc_thread *t, void *ptr) {
+    // The collector may still be tracing through it, leave it to the sweep
+    if (gc->cycle.phase != GC_PHASE_IDLE) return;
+    flush_thread(gc, t);
+    
+    gc_page *p = find_page(gc, ptr);
+    if (p) {
+        // Another thread's allocation buffer is only written by that thread
+        if (p->owner && p->owner != t) return;
+        size_t slot = page_find_slot(p, ptr);
+        if (slot != SIZE_MAX && page_object_start(p, slot) == (char*)ptr) free_page_object(gc, p, slot);
+        return;
+    }
+    
+    // Only recent table entries can be removed without disturbing the
+    // sorted prefix and the cache
+    gc_entry *e = lookup_entry(gc, ptr);
+    size_t i = e ? (size_t)(e - gc->allocs) : 0;
+    if (!e || i < gc->sorted_count) return;
+    free(ptr);
+    gc->allocated_bytes -= e->size;
+    gc->allocs[i] = gc->allocs[--gc->alloc_count];
+}
+
+void gc_free(gc_state *gc, void *ptr) {
+    if (!ptr) return;
+    gc_thread *t = current_thread(gc, "gc_free");
+    gc_region_chunk *c;
+    bool atomic;
+    gc_region *r = t->region ? region_find(t, ptr, &c, &atomic) : NULL;
+    if (gc->profile) {
+        pthread_mutex_lock(&gc->lock);
+        profile_free(gc, r, ptr);
+        pthread_mutex_unlock(&gc->lock);
+    }
+    if (r) {
+        region_free(r, c, ptr);
+        return;
+    }
+    pthread_mutex_lock(&gc->lock);
+    free_locked(gc, t, ptr);
+    pthread_mutex_unlock(&gc->lock);
+}
+
+// Zero the end of a page object that a shrinking realloc gave up. Slots
+// and large objects keep no size of their own, so this is what makes a
+// later grow in place find zeros. Whole pages go back to the kernel.
+static void clear_tail(char *start, char *end) {
+    size_t os_page = (size_t)sysconf(_SC_PAGESIZE);
+    char *first = (char*)(((uintptr_t)start + os_page - 1) & ~(uintptr_t)(os_page - 1));
+    char *last = (char*)((uintptr_t)end & ~(uintptr_t)(os_page - 1));
+    if (last > first && madvise(first, last - first, MADV_DONTNEED) == 0) {
+        memset(start, 0, first - start);
+        memset(last, 0, end - last);
+    } else {
+        memset(start, 0, end - start);
+    }
+}
+
+static void* realloc_locked(gc_state *gc, gc_thread *t, void *ptr, size_t size) {
+    size_t old_size;
+    bool atomic;
+    const gc_layout *layout = NULL;
+    gc_page *p = find_page(gc, ptr);
+    if (p) {
+        size_t slot = page_find_slot(p, ptr);
+        if (slot == SIZE_MAX || page_object_start(p, slot) != (char*)ptr) {
+            fprintf(stderr, "gc_realloc: not a gc allocation\n");
+            exit(1);
+        }
+        // Sizes below cover the typed header too
+        size_t header = 0;
+        if (bit_test(p->typed_bits, slot)) {
+            layout = *(const gc_layout**)slot_ptr(p, slot);
+            header = GC_TYPED_HEADER;
+        }
+        if (size + header <= page_object_capacity(p)) {
+            if (p->size_class == GC_LARGE_CLASS && size + header > p->size) {
+                grow_large(gc, p, size + header);
+            } else if (!bit_test(p->atomic_bits, slot)) {
+                char *start = slot_ptr(p, slot);
+                clear_tail(start + header + size, start + p->size);
+            }
+            return ptr;
+        }
+        if (p->size_class == GC_LARGE_CLASS && grow_large(gc, p, size + header)) return ptr;
+        old_size = p->size - header;
+        atomic = bit_test(p->atomic_bits, slot);
+    } else {
+        gc_entry *e = lookup_entry(gc, ptr);
+        if (!e) { fprintf(stderr, "gc_realloc: not a gc allocation\n"); exit(1); }
+        if (size <= e->size) {
+            // Past the recorded size is neither scanned nor kept on a grow
+            gc->allocated_bytes -= e->size - size;
+            e->size = size;
+            return ptr;
+        }
+        old_size = e->size;
+        atomic = entry_atomic(e);
+    }
+    
+    // ptr stays reachable from this frame if the allocation collects
+    void *new_ptr = alloc_locked(gc, t, size, atomic, layout);
+    memcpy(new_ptr, ptr, old_size);
+    free_locked(gc, t, ptr);
+    return new_ptr;
+}
+
+void* gc_realloc(gc_state *gc, void *ptr, size_t size) {
+    if (!ptr) return gc_alloc(gc, size, false, NULL, __builtin_return_address(0));
+    gc_thread *t = current_thread(gc, "gc_realloc");
+    // Region objects stay in their region, heap objects in the heap
+    gc_region_chunk *c;
+    bool atomic;
+    gc_region *r = t->region ? region_find(t, ptr, &c, &atomic) : NULL;
+    void *new_ptr;
+    if (r) {
+        new_ptr = region_realloc(gc, r, c, atomic, ptr, size);
+    } else {
+        pthread_mutex_lock(&gc->lock);
+        new_ptr = realloc_locked(gc, t, ptr, size);
+        pthread_mutex_unlock(&gc->lock);
+    }
+    if (gc->profile) {
+        // Profiled as a new allocation, the old block is done with
+        pthread_mutex_lock(&gc->lock);
+        profile_free(gc, r, ptr);
+        pthread_mutex_unlock(&gc->lock);
+        profile_note(gc, t, new_ptr, size, __builtin_return_address(0), r);
+    }
+    return new_ptr;
+}
+
+void gc_region_begin(gc_state *gc) {
+    gc_thread *t = current_thread(gc, "gc_region_begin");
+    gc_region *r = (gc_region*)calloc(1, sizeof(gc_region));
+    if (!r) { fprintf(stderr, "gc_region_begin: OOM\n"); exit(1); }
+    pthread_mutex_lock(&gc->lock);
+    r->prev = t->region;
+    t->region = r;
+    pthread_mutex_unlock(&gc->lock);
+}
+
+void gc_region_end(gc_state *gc) {
+    gc_thread *t = current_thread(gc, "gc_region_end");
+    gc_region *r = t->region;
+    if (!r) { fprintf(stderr, "gc_region_end: no region open\n"); exit(1); }
+    double start = get_time_us();
+    pthread_mutex_lock(&gc->lock);
+    t->region = r->prev;
+    region_free_chunks(gc, r->scan);
+    region_free_chunks(gc, r->atomic);
+    if (gc->profile) profile_release_region(gc, r);
+    pthread_mutex_unlock(&gc->lock);
+    if (gc->debug_print_stats) {
+        fprintf(stderr, "GC region: released %zu objects, %zu bytes, %.0fus\n",
+                r->objects, r->bytes, get_time_us() - start);
+    }
+    free(r);
+}
+
+void* gc_region_escape(gc_state *gc, const void *ptr) {
+    if (!ptr) return NULL;
+    gc_thread *t = current_thread(gc, "gc_region_escape");
+    gc_region *r = t->region;
+    gc_region_chunk *c;
+    bool atomic;
+    if (!r || region_find(t, ptr, &c, &atomic) != r) return (void*)ptr;
+    // The region stays open, and scanned, while the copy is allocated
+    size_t size = *region_header(ptr);
+    const gc_layout *layout = *region_layout(ptr);
+    void *copy = r->prev ? region_alloc(gc, r->prev, size, atomic, layout) :
+                           heap_alloc(gc, t, size, atomic, layout);
+    memcpy(copy, ptr, size);
+    if (gc->profile) {
+        // A sampled original's copy is sampled too, charged to the same site
+        pthread_mutex_lock(&gc->lock);
+        gc_profile_object *o = profile_lookup(gc, r, ptr);
+        if (o) profile_alloc(gc, copy, size, o->weight, gc->profile_sites[o->site].site, r->prev);
+        pthread_mutex_unlock(&gc->lock);
+    }
+    return copy;
+}
+
+const void* gc_profile_enter(gc_state *gc, const void *site) {
+    if (!gc->profile) return NULL;
+    gc_thread *t = current_thread(gc, "gc_profile_enter");
+    const void *saved = t->profile_site;
+    if (!saved) t->profile_site = site;
+    return saved;
+}
+
+void gc_profile_leave(gc_state *gc, const void *saved) {
+    if (!gc->profile) return;
+    current_thread(gc, "gc_profile_leave")->profile_site = saved;
+}
+
+void gc_profile_report(gc_state *gc, FILE *out, size_t top) {
+    pthread_mutex_lock(&gc->lock);
+    size_t n = gc->profile_site_count;
+    size_t sample = gc->profile_sample;
+    gc_profile_site *sites = (gc_profile_site*)malloc((n ? n : 1) * sizeof(gc_profile_site));
+    if (!sites) { pthread_mutex_unlock(&gc->lock); return; }
+    memcpy(sites, gc->profile_sites, n * sizeof(gc_profile_site));
+    pthread_mutex_unlock(&gc->lock);
+    
+    size_t allocs = 0, bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        allocs += sites[i].allocs;
+        bytes += sites[i].bytes;
+    }
+    qsort(sites, n, sizeof(gc_profile_site), profile_compare);
+    if (top > n) top = n;
+    fprintf(out, "GC profile (pid %d): %zu allocations, %zu bytes from %zu sites, top %zu by bytes\n",
+            (int)getpid(), allocs, bytes, n, top);
+    if (sample) fprintf(out, "Estimated from one sample per %zu bytes allocated\n", sample);
+    fprintf(out, "%10s %12s %12s %12s %11s  %s\n", "allocs", "bytes", "survived", "live", "avg life", "site");
+    for (size_t i = 0; i < top; i++) {
+        gc_profile_site *s = &sites[i];
+        fprintf(out, "%10zu %12zu %12zu %12zu ", s->allocs, s->bytes, s->survived_bytes, s->live_bytes);
+        if (s->deaths) fprintf(out, "%9.1fms  ", s->lifetime_us / s->deaths / 1000.0);
+        else fprintf(out, "%11s  ", "-");
+        profile_print_site(out, s->site);
+        fputc('\n', out);
+    }
+    free(sites);
+}
+
+size_t gc_allocated_bytes(gc_state *gc) {
+    pthread_mutex_lock(&gc->lock);
+    size_t bytes = gc->allocated_bytes;
+    pthread_mutex_unlock(&gc->lock);
+    return bytes;
+}
+
+bool gc_incremental_marking(gc_state *gc) {
+    pthread_mutex_lock(&gc->lock);
+    bool split = vdb_available(gc);
+    pthread_mutex_unlock(&gc->lock);
+    return split;
+}
+
+void gc_write_stats(gc_state *gc, FILE *out) {
+    pthread_mutex_lock(&gc->lock);
+    note_peak(gc);
+    gc_stats s = gc->stats;
+    // Incremental mode without soft-dirty bits marks in one pause
+    bool incremental_marking = gc->incremental_step_us && vdb_available(gc);
+    size_t major = gc->major_count, minor = gc->minor_count, heap = gc->allocated_bytes;
+    size_t threshold = gc->threshold, rss = read_rss();
+    pthread_mutex_unlock(&gc->lock);
+    
+    size_t lookups = s.cache_hits + s.cache_misses;
+    fprintf(out, "{\"pid\":%d,\"collections\":%zu,\"minor_collections\":%zu,"
+            "\"pauses\":%zu,\"pause_total_us\":%.0f,\"pause_max_us\":%.0f,\"pause_histogram\":[",
+            (int)getpid(), major, minor, s.pauses, s.pause_total_us, s.pause_max_us);
+    for (size_t i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        // Upper bound of the bucket, null for the open last one
+        if (i < GC_PAUSE_BUCKETS - 1)
+            fprintf(out, "%s{\"lt_us\":%llu,\"count\":%zu}", i ? "," : "",
+                    1ull << (i + GC_PAUSE_BUCKET_SHIFT), s.pause_buckets[i]);
+        else
+            fprintf(out, ",{\"lt_us\":null,\"count\":%zu}", s.pause_buckets[i]);
+    }
+    fprintf(out, "],\"bytes_scanned\":%zu,\"freed_objects\":%zu,\"freed_bytes\":%zu,"
+            "\"cache_hits\":%zu,\"cache_misses\":%zu,\"cache_hit_rate\":%.4f,"
+            "\"heap_bytes\":%zu,\"peak_heap_bytes\":%zu,\"threshold_bytes\":%zu,"
+            "\"rss_bytes\":%zu,\"rss_trims\":%zu,\"rss_before_bytes\":%zu,\"rss_after_bytes\":%zu,"
+            "\"rss_returned_bytes\":%zu,\"compactions\":%zu,\"moved_objects\":%zu,\"moved_bytes\":%zu,"
+            "\"incremental_marking\":%s}\n",
+            s.bytes_scanned, s.freed_objects, s.freed_bytes,
+            s.cache_hits, s.cache_misses, lookups ? (double)s.cache_hits / lookups : 0.0,
+            heap, s.peak_bytes, threshold,
+            rss, s.rss_trims, s.rss_before_bytes, s.rss_after_bytes, s.rss_returned_bytes,
+            s.compactions, s.moved_objects, s.moved_bytes, incremental_marking ? "true" : "false");
+    fflush(out);
+}
+
+void gc_add_root(gc_state *gc, void *ptr, size_t size) {
+    pthread_mutex_lock(&gc->lock);
+    if (gc->root_count >= gc->root_capacity) {
+        size_t n = gc->root_capacity * 2;
+        gc_root *nr = (gc_root*)realloc(gc->roots, n * sizeof(gc_root));
+        if (!nr) { fprintf(stderr, "gc_add_root: OOM\n"); pthread_mutex_unlock(&gc->lock); return; }
+        gc->roots = nr; gc->root_capacity = n;
+    }
+    gc->roots[gc->root_count++] = (gc_root){ .ptr = ptr, .size = size };
+    pthread_mutex_unlock(&gc->lock);
+}
+
+gc_weak* gc_weak_new(gc_state *gc, void *ptr) {
+    gc_thread *t = current_thread(gc, "gc_weak_new");
+    gc_weak *w = (gc_weak*)heap_alloc(gc, t, sizeof(gc_weak), true, NULL);
+    pthread_mutex_lock(&gc->lock);
+    w->target = ptr;
+    if (gc->weak_count >= gc->weak_capacity) {
+        size_t n = gc->weak_capacity ? gc->weak_capacity * 2 : 64;
+        gc_weak **nw = (gc_weak**)realloc(gc->weak_refs, n * sizeof(gc_weak*));
+        if (!nw) { fprintf(stderr, "gc_weak_new: OOM\n"); exit(1); }
+        gc->weak_refs = nw; gc->weak_capacity = n;
+    }
+    gc->weak_refs[gc->weak_count++] = w;
+    pthread_mutex_unlock(&gc->lock);
+    return w;
+}
+
+void* gc_weak_get(gc_weak *w) {
+    // Targets are only cleared with every registered thread stopped, and a
+    // stopped thread's registers are scanned, so no lock is needed
+    return __atomic_load_n(&w->target, __ATOMIC_RELAXED);
+}
+
+void gc_add_pressure_callback(gc_state *gc, gc_pressure_fn fn, void *data) {
+    pthread_mutex_lock(&gc->lock);
+    if (gc->pressure_count >= gc->pressure_capacity) {
+        size_t n = gc->pressure_capacity ? gc->pressure_capacity * 2 : 4;
+        gc_pressure_callback *nc = (gc_pressure_callback*)realloc(gc->pressure_callbacks, n * sizeof(gc_pressure_callback));
+        if (!nc) { fprintf(stderr, "gc_add_pressure_callback: OOM\n"); exit(1); }
+        gc->pressure_callbacks = nc; gc->pressure_capacity = n;
+    }
+    gc->pressure_callbacks[gc->pressure_count++] = (gc_pressure_callback){ .fn = fn, .data = data };
+    pthread_mutex_unlock(&gc->lock);
+}
+
+void gc_remove_pressure_callback(gc_state *gc, gc_pressure_fn fn, void *data) {
+    pthread_mutex_lock(&gc->lock);
+    for (size_t i = 0; i < gc->pressure_count; i++) {
+        if (gc->pressure_callbacks[i].fn == fn && gc->pressure_callbacks[i].data == data) {
+            memmove(&gc->pressure_callbacks[i], &gc->pressure_callbacks[i + 1],
+                    (gc->pressure_count - i - 1) * sizeof(gc_pressure_callback));
+            gc->pressure_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gc->lock);
+}
+
+void gc_remove_root(gc_state *gc, void *ptr) {
+    pthread_mutex_lock(&gc->lock);
+    for (size_t i = 0; i < gc->root_count; i++) {
+        if (gc->roots[i].ptr == ptr) {
+            gc->roots[i] = gc->roots[gc->root_count - 1];
+            gc->root_count--;
+            break;
         }
     }
+    pthread_mutex_unlock(&gc->lock);
 }
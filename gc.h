@@ -3,6 +3,12 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 /*
  * Standalone Mark-and-Sweep Garbage Collector
@@ -16,19 +22,29 @@
  * - Conservative stack scanning to find roots
 *  - Handles interior pointers
  * - Support for explicit root registration
+ * - Pointer-free (atomic) and precisely traced (typed) allocations
+ * - Size-class pages for small objects, individual mappings for large ones
+ * - Generational nursery collected by cheap minor collections
+ * - Optional incremental, parallel marking and background sweeping
+ * - Multiple threads, each registered with gc_register_thread
+ * - Regions, weak references, memory pressure callbacks and compaction
+ * - Heap profile by allocation site and cumulative statistics
+ * 
+ * See doc/gc.md for how these work.
  * 
  * Limitations:
  * - Conservative: May keep dead memory alive if integers look like pointers
- * - Not thread-safe (single-threaded use only)
+ *   (stacks, roots and untyped objects)
  * - May not work with some optimizations that hide pointers
  */
 
 
 
 // GC allocation entry
-// The mark bit is stored in the low bit of ptr (assumes at least 2-byte alignment)
+// The mark bit is stored in the low bit of ptr and the atomic (pointer-free)
+// flag in the next bit (assumes at least 4-byte alignment)
 typedef struct gc_entry {
-    uintptr_t ptr_and_mark; // User pointer with mark bit in LSB
+    uintptr_t ptr_and_mark; // User pointer with mark and atomic bits in the low bits
     size_t size;            // Allocation size
 } gc_entry;
 
@@ -38,6 +54,230 @@ typedef struct gc_root {
     size_t size;            // Size of root area
 } gc_root;
 
+// Weak reference made by gc_weak_new, a pointer-free heap object
+typedef struct gc_weak {
+    void *target;           // Referred object, NULL once collected
+} gc_weak;
+
+struct gc_state;
+
+// Memory pressure callback, given the heap size that triggered it
+typedef void (*gc_pressure_fn)(struct gc_state *gc, size_t allocated, void *data);
+
+typedef struct gc_pressure_callback {
+    gc_pressure_fn fn;      // Function to call
+    void *data;             // Its argument
+} gc_pressure_callback;
+
+// Range of memory queued for scanning during marking
+typedef struct gc_mark_range {
+    void *start;
+    void *end;
+} gc_mark_range;
+
+// Page geometry
+#define GC_PAGE_SHIFT 16
+#define GC_PAGE_SIZE (1 << GC_PAGE_SHIFT) // Pages are aligned to their size
+#define GC_GRANULE 16               // Smallest size class (malloc alignment)
+#define GC_PAGE_MAX_SLOTS (GC_PAGE_SIZE / GC_GRANULE)
+#define GC_PAGE_WORDS (GC_PAGE_MAX_SLOTS / 64)
+#define GC_SMALL_MAX 4096           // Larger objects come from malloc
+#define GC_LARGE_MIN (64*1024)      // Objects this big get their own mapping
+#define GC_SIZE_CLASSES 28
+#define GC_LARGE_CLASS GC_SIZE_CLASSES // Size class of a large object's header
+
+// Layout of a typed allocation: one element of size bytes, with bit i of
+// ptr_words set when word i may point into the gc heap. Bigger objects are
+// arrays of elements, the pattern repeats.
+typedef struct gc_layout {
+    size_t size;                // Element size, a multiple of sizeof(void*)
+    uint64_t ptr_words;         // Pointer words of an element (at most 64 words)
+} gc_layout;
+
+// gc_layout.ptr_words bit for a pointer field
+#define GC_LAYOUT_FIELD(type, field) ((uint64_t)1 << (offsetof(type, field) / sizeof(void*)))
+
+#define GC_TYPED_HEADER GC_GRANULE  // Hidden header of a typed object, keeps it aligned
+
+struct gc_thread;
+struct gc_region;
+
+// Pause histogram: bucket i counts pauses under 2^(i + GC_PAUSE_BUCKET_SHIFT)
+// microseconds, the last one everything longer
+#define GC_PAUSE_BUCKETS 16
+#define GC_PAUSE_BUCKET_SHIFT 4
+
+// Counters since gc_init
+typedef struct gc_stats {
+    size_t pauses;              // Pauses of the program
+    size_t pause_buckets[GC_PAUSE_BUCKETS]; // Pause count by duration
+    double pause_total_us;      // Time spent paused
+    double pause_max_us;        // Longest pause
+    size_t bytes_scanned;       // Bytes scanned by all collections
+    size_t freed_objects;       // Objects freed by collections
+    size_t freed_bytes;         // Bytes freed by collections
+    size_t cache_hits;          // Table lookups answered by the direct mapped cache
+    size_t cache_misses;        // Table lookups that had to search
+    size_t peak_bytes;          // Largest heap seen at a collection or export
+    size_t rss_trims;           // Times memory was returned to get under rss_target
+    size_t rss_before_bytes;    // Resident set before the last trim
+    size_t rss_after_bytes;     // And after it
+    size_t rss_returned_bytes;  // Resident set given up by all trims
+    size_t compactions;         // Full collections that compacted
+    size_t moved_objects;       // Objects moved by compaction
+    size_t moved_bytes;         // Bytes moved by compaction
+} gc_stats;
+
+// Heap profile totals of an allocation site
+typedef struct gc_profile_site {
+    const void *site;           // Code address allocations are charged to
+    size_t allocs;              // Objects allocated
+    size_t bytes;               // Bytes allocated
+    size_t survived_bytes;      // Bytes of objects that lived through a full collection
+    size_t live_bytes;          // Bytes of objects not found dead yet
+    size_t deaths;              // Objects found dead
+    double lifetime_us;         // Summed lifetime of the dead ones
+} gc_profile_site;
+
+// Allocation sampled by the heap profile
+typedef struct gc_profile_object {
+    void *ptr;                  // Address handed out, NULL for a free slot
+    size_t size;                // Requested size
+    size_t weight;              // Bytes allocated since the previous sample, this one included
+    double birth_us;            // Allocation time
+    uint32_t site;              // Index of its site
+    bool survived;              // Lived through a full collection
+} gc_profile_object;
+
+// Chunk of a region, objects are bump allocated after the header and each
+// one is preceded by a GC_REGION_HEADER byte header holding its size and layout
+typedef struct gc_region_chunk {
+    struct gc_region_chunk *next; // Next chunk of the region (or spare list)
+    size_t size;                // Usable bytes after the header
+    size_t used;                // Bytes handed out
+} gc_region_chunk;
+
+// Allocation region of a thread
+typedef struct gc_region {
+    gc_region_chunk *scan;      // Chunks of pointer-bearing objects, current one first
+    gc_region_chunk *atomic;    // Chunks of pointer-free objects, current one first
+    size_t bytes;               // Bytes allocated in the region
+    size_t objects;             // Objects allocated in the region
+    gc_profile_object *profile; // Sampled objects allocated in the region
+    size_t profile_count;       // Number of them
+    size_t profile_capacity;    // Capacity of the profile array
+    struct gc_region *prev;     // Enclosing region
+} gc_region;
+
+// Bookkeeping of a page compaction is emptying, only while it runs
+typedef struct gc_evacuation {
+    uint64_t pinned[GC_PAGE_WORDS]; // Objects a conservative reference points at
+    uint64_t moved[GC_PAGE_WORDS];  // Objects copied out, their first word holds the copy's address
+} gc_evacuation;
+
+// Page header, stored at the start of the page
+// Bitmaps have one bit per slot, slot i starts i * size bytes past the header.
+typedef struct gc_page {
+    uint64_t alloc_bits[GC_PAGE_WORDS];   // Slots holding an object
+    uint64_t mark_bits[GC_PAGE_WORDS];    // Reachable (or promoted) objects
+    uint64_t atomic_bits[GC_PAGE_WORDS];  // Pointer-free objects
+    uint64_t typed_bits[GC_PAGE_WORDS];   // Objects with a layout in their header
+    struct gc_page *next;       // Next page of the size class (or free list)
+    uint32_t size_class;        // Size class index, or GC_LARGE_CLASS
+    size_t size;                // Slot size in bytes
+    uint32_t size_recip;        // ceil(2^32 / size), to divide offsets by size
+    uint32_t slots;             // Number of slots
+    uint32_t live;              // Allocated slots
+    bool exhausted;             // No free slot left until the next sweep
+    struct gc_thread *owner;    // Thread allocating from this page, if any
+    gc_evacuation *evac;        // Set while compaction empties the page
+} gc_page;
+
+// Registered thread
+typedef struct gc_thread {
+    struct gc_state *gc;        // Collector the thread is registered with
+    pthread_t id;               // Target for suspend and resume signals
+    void *stack_bottom;         // Bottom of the thread's stack
+    void *stack_top;            // Stack pointer saved while suspended
+    jmp_buf regs;               // Registers saved while suspended
+    
+    // Thread-local allocation buffer: the page of each size class the
+    // thread allocates from without the lock
+    gc_page *alloc_page[GC_SIZE_CLASSES];
+    size_t alloc_slot[GC_SIZE_CLASSES];     // Slot where each search resumes
+    size_t pending_bytes;       // Allocated without the lock, not yet in the totals
+    size_t pending_objects;     // Objects allocated without the lock
+    volatile sig_atomic_t in_alloc;        // Inside the lock-free allocation path
+    volatile sig_atomic_t suspend_pending; // A suspend request arrived in there
+    gc_region *region;          // Innermost region the thread allocates from, if any
+    const void *profile_site;   // Caller of the outermost allocation wrapper running
+    size_t profile_pending;     // Bytes allocated since the last sample
+    size_t profile_next;        // Pending bytes that take the next sample, 0 until drawn
+    uint64_t profile_rng;       // State of the sampling interval generator
+    
+    struct gc_thread *next;     // Next registered thread
+} gc_thread;
+
+// Parallel marker's queue of ranges to scan. The owner pushes and pops at
+// the bottom of the deque, others steal from the top (Chase-Lev); ranges
+// that don't fit wait in a private overflow stack.
+typedef struct gc_mark_worker {
+    struct gc_state *gc;        // Collector the worker marks for
+    gc_mark_range *deque;       // Ring of GC_MARK_DEQUE_SIZE ranges
+    int64_t top;                // Next range to steal
+    int64_t bottom;             // Next free slot for the owner
+    gc_mark_range *overflow;    // Ranges pushed while the deque was full
+    size_t overflow_size;       // Number of overflow ranges
+    size_t overflow_capacity;   // Capacity of the overflow stack
+    size_t bytes_scanned;       // Scanned during the current round
+    size_t bytes_skipped;       // Atomic bytes marked during the current round
+    size_t bytes_typed;         // Non-pointer bytes of typed objects not loaded
+    size_t cache_hits;          // Table lookups answered by the cache
+    size_t cache_misses;        // Table lookups that searched
+    pthread_t thread;           // Helper thread (unused for the collector's own)
+} gc_mark_worker;
+
+// Collection phases
+typedef enum gc_phase {
+    GC_PHASE_IDLE,              // No collection in progress
+    GC_PHASE_SETUP,             // Sorting allocations and rebuilding the cache
+    GC_PHASE_MARK,              // Tracing reachable objects
+    GC_PHASE_SWEEP,             // Freeing unmarked allocations
+} gc_phase;
+
+// Progress of the current collection cycle
+typedef struct gc_cycle {
+    gc_phase phase;             // Current phase
+    bool incremental;           // Program may run between steps of this cycle
+    bool mutator_ran;           // Program ran while marking was in progress
+    bool dirty_tracking;        // Soft-dirty bits were cleared when marking began
+    bool background_sweep;      // Sweep is left to the sweeper thread
+    size_t count;               // Allocations in the cycle (sorted prefix of allocs)
+    
+    // Setup: sort of the new entries and merge into the sorted prefix
+    int setup_stage;            // Which part of setup is running
+    size_t pos;                 // Cursor within the current stage
+    gc_entry *tmp;              // Radix sort and merge buffer
+    bool in_tmp;                // Radix sort output currently lives in tmp
+    size_t i, j;                // Merge inputs left
+    
+    // Sweep
+    size_t sweep_write;         // Compaction cursor
+    size_t sweep_page;          // Next page to sweep
+    
+    // Statistics
+    size_t old_count;           // Allocation count when the cycle started
+    size_t old_bytes;           // Allocated bytes when the cycle started
+    size_t freed_count;         // Allocations freed by the sweep
+    size_t freed_bytes;         // Bytes freed by the sweep
+    size_t moved_count;         // Objects moved by compaction, their old slots are swept
+    size_t moved_bytes;         // Bytes moved by compaction
+    size_t steps;               // Number of steps taken
+    double setup_us, mark_us, sweep_us; // Time spent per phase
+    double max_pause_us;        // Longest single step
+    double begin_us;            // When the cycle started
+} gc_cycle;
+
 // Platform-specific macro to get stack pointer
 // Usage: void *sp; GC_GET_STACK_POINTER(&sp);
 #if defined(__x86_64__) || defined(__amd64__)
@@ -62,18 +302,138 @@ typedef struct gc_root {
 
 // GC state
 typedef struct gc_state {
-    gc_entry *allocs;           // Array of allocations (sorted by ptr)
+    gc_entry *allocs;           // Array of allocations (sorted prefix, then new ones)
     size_t alloc_count;         // Number of allocations
+    size_t sorted_count;        // Leading allocations already sorted by ptr
     size_t alloc_capacity;      // Capacity of allocations array
     size_t allocated_bytes;     // Total allocated memory
     size_t threshold;           // Collection threshold
+    unsigned defer_depth;       // Nesting of gc_defer_begin
+    size_t rss_target;          // Resident set a full collection trims down towards, 0 for none
+    bool compact;               // Empty sparse pages in full collections (see doc/gc.md)
+    
+    // Threshold policy, see doc/gc.md
+    double target_pause_us;     // Longest full collection pause wanted, 0 for none
+    double target_gc_share;     // Largest fraction of run time spent in full collections, 0 for none
+    double mark_cost_us;        // Smoothed mark time of a cycle
+    double heap_cost_us;        // Smoothed setup and sweep time per byte of heap
+    double pause_heap_cost_us;  // The part of heap_cost_us the program waits for
+    double alloc_rate;          // Smoothed heap growth between cycles, bytes per us
+    double last_cycle_end_us;   // When the last full collection finished
+    size_t last_live_bytes;     // What it left behind
+    size_t idle_base_bytes;     // Old bytes after the last collection of either kind, for gc_idle
     void *stack_bottom;         // Bottom of stack for scanning
     
     // Direct mapped cache for fast lookups
-    gc_entry **cache;           // Direct mapped cache (pointers to entries)
+    gc_entry **cache;           // Direct mapped cache (pointers to sorted entries)
     size_t cache_size;          // Size of cache (power of 2)
     size_t cache_mask;          // Mask for cache indexing (size - 1)
     
+    // Heap bounds, valid during collection
+    void *heap_min;             // Lowest allocation address
+    void *heap_max;             // End of highest allocation
+    uint64_t *scan_filter;      // Bit per 1MB block of address space holding heap memory (hashed)
+    
+    // Explicit mark stack (replaces recursion during marking)
+    gc_mark_range *mark_stack;  // Ranges waiting to be scanned
+    size_t mark_stack_size;     // Number of queued ranges
+    size_t mark_stack_capacity; // Capacity of mark stack
+    
+    // Size-class pages
+    gc_page ***page_map;        // Two-level map from page number to page
+    gc_page **pages;            // Pages in use, in no particular order
+    size_t page_count;          // Number of pages in use
+    size_t page_capacity;       // Capacity of pages array
+    gc_page *class_pages[GC_SIZE_CLASSES]; // Pages of each size class
+    gc_page *free_pages;        // Empty pages, reusable by any class
+    size_t free_page_count;     // Number of empty pages
+    void **arenas;              // Mapped arenas that pages are carved from
+    size_t arena_count;         // Number of arenas
+    size_t arena_capacity;      // Capacity of arenas array
+    char *arena_next;           // Next unused page of the newest arena
+    char *arena_end;            // End of the newest arena
+    void *page_min;             // Start of the lowest arena
+    void *page_max;             // End of the highest arena
+    size_t page_object_count;   // Objects living in pages
+    
+    // Nursery
+    size_t young_bytes;         // Nursery bytes allocated since the last collection
+    size_t nursery_size;        // Young bytes that trigger a minor collection
+    size_t minor_count;         // Number of minor collections
+    size_t major_count;         // Number of full collections
+    bool remembered_clean;      // Soft-dirty bits were reset by the last collection
+    
+    // Collection in progress
+    gc_cycle cycle;             // Current cycle state
+    unsigned incremental_step_us; // Per-step budget, 0 for stop-the-world collection
+    size_t alloc_since_step;    // Bytes allocated since the last step
+    
+    // Dirty page tracking (Linux soft-dirty bits) for incremental marking
+    bool vdb_checked;           // Support has been probed
+    int vdb_pagemap_fd;         // /proc/self/pagemap, -1 when unavailable
+    int vdb_clear_refs_fd;      // /proc/self/clear_refs, -1 when unavailable
+    uint64_t *vdb_window;       // Cached pagemap entries
+    uintptr_t vdb_window_first; // First page number in the window
+    size_t vdb_window_len;      // Valid entries in the window
+    
+    // Threads
+    pthread_mutex_t lock;       // Guards everything but the lock-free allocation path (recursive)
+    gc_thread *threads;         // Registered threads
+    size_t thread_count;        // Number of registered threads
+    int world_stopped;          // Nesting depth of stop_world
+    unsigned resume_count;      // Bumped to release suspended threads
+    sem_t suspend_ack;          // Posted by threads as they suspend and resume
+    bool signals_installed;     // Handlers are in place, the old actions saved
+    struct sigaction old_suspend_action; // Restored when back to one thread
+    struct sigaction old_resume_action;
+    
+    // Parallel marking
+    unsigned mark_threads;      // Threads marking large heaps, 0 or 1 for serial marking
+    gc_mark_worker *mark_workers; // The collecting thread's worker, then one per helper
+    unsigned mark_helpers;      // Helper threads started
+    pthread_mutex_t mark_lock;  // Guards the round handshake below
+    pthread_cond_t mark_wake;   // Signals helpers that a round started
+    pthread_cond_t mark_done;   // Signals the collector that helpers finished
+    unsigned mark_round;        // Bumped to start a round of marking
+    unsigned mark_finished;     // Helpers done with the current round
+    bool mark_quit;             // Helpers exit at the next wake-up
+    int mark_active;            // Workers that may still produce work
+    
+    // Background sweeping
+    bool background_sweep;      // Hand sweeps to a sweeper thread
+    bool sweeper_started;       // Sweeper thread running
+    bool sweeper_quit;          // Sweeper exits at the next wake-up
+    pthread_t sweeper;          // Sweeper thread
+    pthread_cond_t sweep_wake;  // Signals the sweeper that a sweep is waiting (with lock)
+    void **sweep_batch;         // Dead blocks for the sweeper to free, while it sweeps
+    size_t sweep_batch_count;   // Number of queued blocks
+    
+    // Regions
+    gc_region_chunk *region_spare; // Standard size chunks kept for the next region
+    size_t region_spare_count;  // Number of spare chunks
+    size_t region_bytes;        // Chunk bytes held by open regions, counted towards the threshold
+    
+    // Heap profile
+    bool profile;               // Record allocation sites and lifetimes
+    size_t profile_sample;      // Mean bytes between sampled allocations, 0 to record all
+    gc_profile_site *profile_sites; // Sites in order of first allocation
+    size_t profile_site_count;  // Number of sites
+    size_t profile_site_capacity; // Capacity of the sites array
+    uint32_t *profile_site_index; // Hash of site address to index + 1
+    gc_profile_object *profile_objects; // Hash of sampled heap objects by address
+    size_t profile_object_count; // Number of tracked objects
+    size_t profile_object_capacity; // Capacity of the object hash (power of 2)
+    
+    // Weak references and memory pressure
+    gc_weak **weak_refs;        // Weak references that may still be alive
+    size_t weak_count;          // Number of them
+    size_t weak_capacity;       // Capacity of weak_refs
+    size_t pressure_limit;      // Heap size the program wants to stay under, 0 for none
+    size_t pressure_next;       // Heap size that fires the callbacks next, 0 until a collection sets it
+    gc_pressure_callback *pressure_callbacks; // Registered callbacks
+    size_t pressure_count;      // Number of callbacks
+    size_t pressure_capacity;   // Capacity of pressure_callbacks
+    
     // Root management
     gc_root *roots;             // Array of registered roots
     size_t root_count;          // Number of registered roots
@@ -82,23 +442,88 @@ typedef struct gc_state {
     // Debug flags
     int debug_stress;           // Force GC on every allocation
     int debug_print_stats;      // Print statistics during collection
+    bool typed_scan;            // Trace typed objects through their layout (default),
+                                // otherwise scan them conservatively like the rest
     
     // Statistics for current collection
     size_t bytes_scanned;       // Bytes scanned during current collection
+    size_t bytes_skipped;       // Bytes of reachable atomic allocations not scanned
+    size_t bytes_typed;         // Non-pointer bytes of reachable typed objects not scanned
+    gc_stats stats;             // Totals since gc_init
 } gc_state;
 
-// Initialize GC with stack bottom
+// Initialize GC with stack bottom, registering the calling thread
 void gc_init(gc_state *gc, void *stack_bottom);
 
+// Register the calling thread, stack_bottom as for gc_init
+void gc_register_thread(gc_state *gc, void *stack_bottom);
+
+// Unregister the calling thread, before it exits
+void gc_unregister_thread(gc_state *gc);
+
 // Clean up GC
 void gc_cleanup(gc_state *gc);
 
 // Allocate memory with GC tracking
 void* gc_malloc(gc_state *gc, size_t size);
 
-// Force a garbage collection
+// Allocate memory whose contents are never scanned for pointers (strings,
+// byte buffers). Unlike gc_malloc the memory is not zeroed.
+void* gc_malloc_atomic(gc_state *gc, size_t size);
+
+// Allocate zeroed memory traced only through the pointer words of layout,
+// which must outlive the object. size may cover an array of elements.
+void* gc_malloc_typed(gc_state *gc, size_t size, const gc_layout *layout);
+
+// Resize an allocation, keeping its contents and its atomic flag or layout.
+// Memory past the old size is zeroed unless atomic.
+void* gc_realloc(gc_state *gc, void *ptr, size_t size);
+
+// Free an allocation the program knows to be unreachable. Pointers that are
+// not the start of a gc allocation are ignored.
+void gc_free(gc_state *gc, void *ptr);
+
+// Force a garbage collection (finishes any incremental cycle in progress)
 void gc_collect(gc_state *gc);
 
+// Collect only the nursery's young objects
+void gc_collect_minor(gc_state *gc);
+
+// Open a region on the calling thread, nested in any region already open.
+// The thread's allocations come from it until the matching gc_region_end.
+void gc_region_begin(gc_state *gc);
+
+// Release everything allocated in the calling thread's innermost region
+void gc_region_end(gc_state *gc);
+
+// Shallow copy of the object starting at ptr out of the calling thread's
+// innermost region, objects outside it are returned as they are.
+void* gc_region_escape(gc_state *gc, const void *ptr);
+
+// Allocation wrappers bracket their work with these, passing their own
+// __builtin_return_address(0), so the heap profile charges their caller.
+const void* gc_profile_enter(gc_state *gc, const void *site);
+void gc_profile_leave(gc_state *gc, const void *saved);
+
+// Print the top sites of the heap profile by bytes allocated
+void gc_profile_report(gc_state *gc, FILE *out, size_t top);
+
+// Do collection work early because the program is about to wait anyway.
+// Returns whether it did anything, cheap when there is nothing to do.
+bool gc_idle(gc_state *gc);
+
+// Put off collections during latency critical stretches, until the heap is
+// twice past the usual trigger. They nest.
+void gc_defer_begin(gc_state *gc);
+void gc_defer_end(gc_state *gc);
+
+// Write the cumulative statistics as a JSON object and a newline
+void gc_write_stats(gc_state *gc, FILE *out);
+
+// Whether incremental mode can split marking into steps, which needs the
+// kernel's soft-dirty page bits. Otherwise each cycle marks in one pause.
+bool gc_incremental_marking(gc_state *gc);
+
 // Get total allocated bytes
 size_t gc_allocated_bytes(gc_state *gc);
 
@@ -108,4 +533,16 @@ void gc_add_root(gc_state *gc, void *ptr, size_t size);
 // Remove a root from GC scanning
 void gc_remove_root(gc_state *gc, void *ptr);
 
+// Make a weak reference to the heap object at ptr. Don't gc_free the
+// reference or its target.
+gc_weak* gc_weak_new(gc_state *gc, void *ptr);
+
+// The referred object, or NULL once a collection found it unreachable
+void* gc_weak_get(gc_weak *w);
+
+// Call fn with the lock held when the heap nears pressure_limit, before a
+// full collection. It must not add or remove callbacks.
+void gc_add_pressure_callback(gc_state *gc, gc_pressure_fn fn, void *data);
+void gc_remove_pressure_callback(gc_state *gc, gc_pressure_fn fn, void *data);
+
 #endif // GC_H
\ No newline at end of file
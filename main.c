@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include "util.h"
 #include "string.h"
 #include "agent.h"
@@ -20,15 +21,52 @@ gc_state gc;
 #define MINICODER_VERSION "dev"
 #endif
 
+// Nodes are traced through their links and strings only, the type,
+// valueint and valuedouble words never keep anything alive
+static const gc_layout cjson_layout = {
+    .size = sizeof(cJSON),
+    .ptr_words = GC_LAYOUT_FIELD(cJSON, next) | GC_LAYOUT_FIELD(cJSON, prev) |
+                 GC_LAYOUT_FIELD(cJSON, child) | GC_LAYOUT_FIELD(cJSON, valuestring) |
+                 GC_LAYOUT_FIELD(cJSON, string),
+};
+
 // Wrapper functions for cJSON hooks
 static void *cjson_malloc_wrapper(size_t size) {
-    return gc_malloc(&gc, size);
+    // cJSON only allocates nodes and character buffers (keys, values and
+    // printed output), so anything that is not node sized is pointer-free.
+    // The heap profile charges the cJSON function that asked.
+    const void *saved = gc_profile_enter(&gc, __builtin_return_address(0));
+    void *p = size != sizeof(cJSON) ? gc_malloc_atomic(&gc, size) :
+                                      gc_malloc_typed(&gc, size, &cjson_layout);
+    gc_profile_leave(&gc, saved);
+    return p;
 }
 
 static void cjson_free_wrapper(void *ptr) {
     // gc doesn't have explicit free, do nothing
 }
 
+// Where the heap profile goes, if one is kept
+static FILE *profile_out = NULL;
+
+// Print the heap profile once, on return from main or on exit() before it
+static void report_profile(void) {
+    if (!profile_out) return;
+    gc_profile_report(&gc, profile_out, 20);
+    if (profile_out != stderr) fclose(profile_out);
+    profile_out = NULL;
+}
+
+// Where the JSON statistics go at exit, if anywhere
+static FILE *stats_out = NULL;
+
+static void write_stats(void) {
+    if (!stats_out) return;
+    gc_write_stats(&gc, stats_out);
+    fclose(stats_out);
+    stats_out = NULL;
+}
+
 // Default files to include if none specified
 
 // Global flag for signal handling
@@ -324,7 +362,109 @@ int main(int argc, char *argv[]) {
         gc.debug_print_stats = 1;
         fprintf(stderr, "GC: Debug stats printing enabled\n");
     }
-    
+
+    // Check for incremental collection environment variable (step budget in us)
+    const char *incremental_env = getenv("MINICODER_GC_INCREMENTAL");
+    if (incremental_env && atoi(incremental_env) > 0) {
+        gc.incremental_step_us = (unsigned)atoi(incremental_env);
+        fprintf(stderr, "GC: Incremental collection enabled (%uus per step)\n", gc.incremental_step_us);
+        if (!gc_incremental_marking(&gc))
+            fprintf(stderr, "GC: Soft-dirty page bits unavailable, marking is not incremental\n");
+    }
+
+    // Check for background sweep environment variable
+    const char *sweep_env = getenv("MINICODER_GC_BACKGROUND_SWEEP");
+    if (sweep_env && strcmp(sweep_env, "1") == 0) {
+        gc.background_sweep = true;
+        fprintf(stderr, "GC: Background sweeping enabled\n");
+    }
+
+    // Check for parallel marking environment variable (number of marking threads)
+    const char *mark_threads_env = getenv("MINICODER_GC_MARK_THREADS");
+    if (mark_threads_env && atoi(mark_threads_env) > 1) {
+        gc.mark_threads = (unsigned)atoi(mark_threads_env);
+        fprintf(stderr, "GC: Parallel marking enabled (%u threads)\n", gc.mark_threads);
+    }
+
+    // Check for threshold policy environment variables: a full collection
+    // pause target in us and a target share of run time in percent
+    const char *target_pause_env = getenv("MINICODER_GC_TARGET_PAUSE_US");
+    if (target_pause_env && atof(target_pause_env) > 0) {
+        gc.target_pause_us = atof(target_pause_env);
+        fprintf(stderr, "GC: Threshold sized for pauses under %.0fus\n", gc.target_pause_us);
+    }
+    const char *target_share_env = getenv("MINICODER_GC_TARGET_SHARE");
+    if (target_share_env && atof(target_share_env) > 0 && atof(target_share_env) < 100) {
+        gc.target_gc_share = atof(target_share_env) / 100;
+        fprintf(stderr, "GC: Threshold sized for %.1f%% of time in collections\n", gc.target_gc_share * 100);
+    }
+
+    // Check for resident set target environment variable (in MB)
+    const char *rss_env = getenv("MINICODER_GC_RSS_TARGET_MB");
+    if (rss_env && atoi(rss_env) > 0) {
+        gc.rss_target = (size_t)atoi(rss_env) << 20;
+        fprintf(stderr, "GC: Resident set target %dMB\n", atoi(rss_env));
+    }
+
+    // Check for compaction environment variable
+    const char *compact_env = getenv("MINICODER_GC_COMPACT");
+    if (compact_env && strcmp(compact_env, "1") == 0) {
+        gc.compact = true;
+        fprintf(stderr, "GC: Compaction of sparse pages enabled\n");
+    }
+
+    // Check for memory pressure limit environment variable (in MB)
+    const char *pressure_env = getenv("MINICODER_GC_PRESSURE_LIMIT_MB");
+    if (pressure_env && atoi(pressure_env) > 0) {
+        gc.pressure_limit = (size_t)atoi(pressure_env) << 20;
+        fprintf(stderr, "GC: Memory pressure limit %dMB\n", atoi(pressure_env));
+    }
+
+    // Typed objects are traced through their layouts unless disabled
+    // (to compare retention against conservative scanning)
+    const char *typed_env = getenv("MINICODER_GC_TYPED_SCAN");
+    if (typed_env && strcmp(typed_env, "0") == 0) {
+        gc.typed_scan = false;
+        fprintf(stderr, "GC: Typed objects scanned conservatively\n");
+    }
+
+    // Check for heap profile environment variable ("1" reports to stderr at
+    // exit, anything else but "0" is a file the report is appended to)
+    const char *profile_env = getenv("MINICODER_DEBUG_PROFILE_GC");
+    if (profile_env && *profile_env && strcmp(profile_env, "0") != 0) {
+        profile_out = strcmp(profile_env, "1") == 0 ? stderr : fopen(profile_env, "a");
+        if (!profile_out) {
+            fprintf(stderr, "GC: Cannot open heap profile %s\n", profile_env);
+        } else {
+            gc.profile = true;
+            atexit(report_profile);
+            fprintf(stderr, "GC: Heap profile enabled\n");
+        }
+    }
+
+    // Check for heap profile sampling environment variable (mean bytes
+    // between samples, 0 records every allocation)
+    const char *sample_env = getenv("MINICODER_DEBUG_PROFILE_GC_SAMPLE");
+    if (gc.profile && sample_env && *sample_env && atoi(sample_env) >= 0) {
+        gc.profile_sample = (size_t)atoi(sample_env);
+        if (gc.profile_sample) fprintf(stderr, "GC: Heap profile samples every %zu bytes\n", gc.profile_sample);
+        else fprintf(stderr, "GC: Heap profile records every allocation\n");
+    }
+
+    // Check for JSON statistics environment variable (a number is a file
+    // descriptor to write to at exit, anything else a file to append to)
+    const char *stats_json_env = getenv("MINICODER_DEBUG_STATS_JSON");
+    if (stats_json_env && *stats_json_env) {
+        if (strspn(stats_json_env, "0123456789") == strlen(stats_json_env)) {
+            int fd = dup(atoi(stats_json_env));
+            stats_out = fd >= 0 ? fdopen(fd, "w") : NULL;
+        } else {
+            stats_out = fopen(stats_json_env, "a");
+        }
+        if (stats_out) atexit(write_stats);
+        else fprintf(stderr, "GC: Cannot open statistics output %s\n", stats_json_env);
+    }
+
     // Initialize cJSON to use gc memory management
     cJSON_Hooks hooks;
     hooks.malloc_fn = cjson_malloc_wrapper;
@@ -352,6 +492,8 @@ int main(int argc, char *argv[]) {
     }
     
     // Clean up the garbage collector
+    report_profile();
+    write_stats();
     gc_cleanup(&gc);
     
     return result;
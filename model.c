@@ -15,6 +15,18 @@ extern gc_state gc;
 // N.B. Because we initialized cJSON elsewhere to use our gc, we don't
 // need to call cJSON free functions manually.
 
+// Only the strings of a model_t point into the gc heap, max_tokens and the
+// type are never mistaken for pointers
+static const gc_layout model_layout = {
+    .size = sizeof(model_t),
+    .ptr_words = GC_LAYOUT_FIELD(model_t, name) | GC_LAYOUT_FIELD(model_t, provider) |
+                 GC_LAYOUT_FIELD(model_t, description) |
+                 GC_LAYOUT_FIELD(model_t, config.openai.endpoint) |
+                 GC_LAYOUT_FIELD(model_t, config.openai.model) |
+                 GC_LAYOUT_FIELD(model_t, config.openai.api_key) |
+                 GC_LAYOUT_FIELD(model_t, config.openai.params),
+};
+
 static model_config_t *create_default_models(void) {
     // Check which API keys are available
     const char *openrouter_key = getenv("OPENROUTER_API_KEY");
@@ -26,7 +38,7 @@ static model_config_t *create_default_models(void) {
     model_config_t *config = gc_malloc(&gc, sizeof(model_config_t));
     config->count = 0;
     size_t capacity = 4;  // Start with small capacity
-    config->models = gc_malloc(&gc, sizeof(model_t) * capacity);
+    config->models = gc_malloc_typed(&gc, sizeof(model_t) * capacity, &model_layout);
     
     // Macro to add a model with automatic capacity management
     // token_limit: the advertised max context length of the model in tokens (input + output)
@@ -34,7 +46,7 @@ static model_config_t *create_default_models(void) {
         do { \
             if (config->count >= capacity) { \
                 capacity *= 2; \
-                model_t *new_models = gc_malloc(&gc, sizeof(model_t) * capacity); \
+                model_t *new_models = gc_malloc_typed(&gc, sizeof(model_t) * capacity, &model_layout); \
                 memcpy(new_models, config->models, sizeof(model_t) * config->count); \
                 config->models = new_models; \
             } \
@@ -259,7 +271,7 @@ static model_config_t *load_models_from_file(const char *path, char **error) {
     }
     
     model_config_t *config = gc_malloc(&gc, sizeof(model_config_t));
-    config->models = gc_malloc(&gc, sizeof(model_t) * count);
+    config->models = gc_malloc_typed(&gc, sizeof(model_t) * count, &model_layout);
     config->count = count;
     
     int index = 0;
@@ -430,6 +442,7 @@ void list_models(model_config_t *config, FILE *stream) {
 struct curl_response {
     char *data;
     size_t size;
+    size_t capacity;
     const model_completion_options_t *options;
     char **error;
 };
@@ -449,15 +462,19 @@ static size_t write_callback(void *contents, size_t size, size_t nmemb, void *us
         }
     }
     
-    char *new_data = gc_malloc(&gc, mem->size + realsize + 1);
-    if (!new_data) {
-        return 0;  // Out of memory
+    if (mem->size + realsize + 1 > mem->capacity) {
+        size_t new_capacity = mem->capacity * 2;
+        while (new_capacity < mem->size + realsize + 1) {
+            new_capacity *= 2;
+        }
+        char *new_data = gc_realloc(&gc, mem->data, new_capacity);
+        if (!new_data) {
+            return 0;  // Out of memory
+        }
+        mem->data = new_data;
+        mem->capacity = new_capacity;
     }
     
-    if (mem->size > 0) {
-        memcpy(new_data, mem->data, mem->size);
-    }
-    mem->data = new_data;
     memcpy(&(mem->data[mem->size]), contents, realsize);
     mem->size += realsize;
     mem->data[mem->size] = 0;
@@ -472,6 +489,7 @@ struct streaming_state {
     const model_completion_options_t *options;
     char **error;
     int done;
+    int deferred;                          // Collections deferred while tokens stream in
 };
 
 // Callback for streaming data from CURL
@@ -479,6 +497,12 @@ static size_t streaming_write_callback(void *contents, size_t size, size_t nmemb
     size_t realsize = size * nmemb;
     struct streaming_state *state = (struct streaming_state *)userp;
     
+    // Keep collection pauses out of the output once it starts
+    if (!state->deferred) {
+        gc_defer_begin(&gc);
+        state->deferred = 1;
+    }
+    
     // Check for cancellation
     if (state->options && state->options->cancellation_callback) {
         if (state->options->cancellation_callback(state->options->cancellation_user_data)) {
@@ -505,28 +529,24 @@ static size_t streaming_write_callback(void *contents, size_t size, size_t nmemb
             
             // Skip empty lines
             if (line_len > 0) {
-                // Process the line
-                char *line = gc_malloc(&gc, line_len + 1);
-                memcpy(line, buffer + line_start, line_len);
-                line[line_len] = '\0';
+                // Process the line where it is in the buffer
+                string_view_t line = string_view(buffer + line_start, line_len);
                 
                 // Remove carriage return if present
-                if (line_len > 0 && line[line_len - 1] == '\r') {
-                    line[line_len - 1] = '\0';
+                if (line.ptr[line.len - 1] == '\r') {
+                    line.len--;
                 }
                 
                 // Check for SSE data line
-                if (strncmp(line, "data: ", 6) == 0) {
-
-                    // We must dup the string for gc root reasons.
-                    const char *data = line + 6;
+                if (string_view_starts_with(line, "data: ")) {
+                    string_view_t data = string_view_slice(line, 6, line.len);
                     
                     // Check for [DONE] message
-                    if (strcmp(data, "[DONE]") == 0) {
+                    if (string_view_equals(data, "[DONE]")) {
                         state->done = 1;
                     } else {
                         // Parse JSON
-                        cJSON *chunk_json = cJSON_Parse(data);
+                        cJSON *chunk_json = cJSON_ParseWithLength(data.ptr, data.len);
                         if (chunk_json) {
                             // Extract content from choices[0].delta.content
                             cJSON *choices = cJSON_GetObjectItem(chunk_json, "choices");
@@ -610,11 +630,24 @@ static size_t streaming_write_callback(void *contents, size_t size, size_t nmemb
     return realsize;
 }
 
-// Progress callback for CURL - used to check for cancellation
+// Per-request data for the progress callback
+struct progress_state {
+    const model_completion_options_t *options;
+    bool idle_done;  // gc_idle already ran for this request
+};
+
+// Progress callback for CURL - used to check for cancellation, and to
+// collect once while waiting for the model to answer
 static int model_curl_xferinfo_callback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
-    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow; // Unused parameters
+    (void)dltotal; (void)ultotal; (void)ulnow; // Unused parameters
     
-    const model_completion_options_t *options = (const model_completion_options_t *)clientp;
+    struct progress_state *progress = (struct progress_state *)clientp;
+    if (dlnow == 0 && !progress->idle_done) {
+        progress->idle_done = true;
+        gc_idle(&gc);
+    }
+    
+    const model_completion_options_t *options = progress->options;
     if (options && options->cancellation_callback) {
         if (options->cancellation_callback(options->cancellation_user_data)) {
             return 1; // Non-zero return aborts the transfer
@@ -670,15 +703,17 @@ static char *openai_completion_streaming(model_t *model, const char *prompt, cJS
     
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
     
-    // Set up progress callback for cancellation checking
-    if (options && options->cancellation_callback) {
-        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, model_curl_xferinfo_callback);
-        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)options);
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L); // Enable progress meter
-    }
+    // Set up progress callback for cancellation checking and idle collection
+    struct progress_state progress = { options, false };
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, model_curl_xferinfo_callback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)&progress);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L); // Enable progress meter
     
     // Perform the request
     CURLcode res = curl_easy_perform(curl);
+    if (state.deferred) {
+        gc_defer_end(&gc);
+    }
     
     // Clean up cURL resources
     curl_slist_free_all(headers);
@@ -703,7 +738,7 @@ static char *openai_completion_streaming(model_t *model, const char *prompt, cJS
     // Process any remaining data in line buffer
     if (state.line_buffer.size > 0 && !state.done) {
         // Check if the remaining data is a JSON error response
-        char *buffer_copy = gc_malloc(&gc, state.line_buffer.size + 1);
+        char *buffer_copy = gc_malloc_atomic(&gc, state.line_buffer.size + 1);
         memcpy(buffer_copy, state.line_buffer.data, state.line_buffer.size);
         buffer_copy[state.line_buffer.size] = '\0';
         
@@ -764,8 +799,10 @@ static char *openai_completion_non_streaming(model_t *model, const char *prompt,
     
     // Prepare response buffer
     struct curl_response response = {0};
-    response.data = gc_malloc(&gc, 1);  // Will be grown as needed
+    response.data = gc_malloc_atomic(&gc, 1);  // Will be grown as needed
+    response.data[0] = '\0';
     response.size = 0;
+    response.capacity = 1;
     response.options = options;
     response.error = error;
     
@@ -795,12 +832,11 @@ static char *openai_completion_non_streaming(model_t *model, const char *prompt,
     
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
     
-    // Set up progress callback for cancellation checking
-    if (options && options->cancellation_callback) {
-        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, model_curl_xferinfo_callback);
-        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)options);
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L); // Enable progress meter
-    }
+    // Set up progress callback for cancellation checking and idle collection
+    struct progress_state progress = { options, false };
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, model_curl_xferinfo_callback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)&progress);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L); // Enable progress meter
     
     // Perform the request
     CURLcode res = curl_easy_perform(curl);
@@ -933,7 +969,8 @@ static char *openai_completion(model_t *model, const char *prompt, const model_c
     cJSON *messages = cJSON_CreateArray();
     cJSON *message = cJSON_CreateObject();
     cJSON_AddStringToObject(message, "role", "user");
-    cJSON_AddStringToObject(message, "content", prompt);
+    // The prompt outlives the request, no need for cJSON to copy it
+    cJSON_AddItemToObject(message, "content", cJSON_CreateStringReference(prompt));
     cJSON_AddItemToArray(messages, message);
     cJSON_AddItemToObject(request_json, "messages", messages);
     
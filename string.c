@@ -1,16 +1,41 @@
 #include "string.h"
 #include "util.h"  // for die()
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 
+// Every allocation in this file goes through these, charged in the heap
+// profile to site: the public function's caller, which it takes with
+// __builtin_return_address(0) and passes down
+static char *string_alloc(gc_state *gc, size_t size, const void *site) {
+    const void *saved = gc_profile_enter(gc, site);
+    char *p = gc_malloc_atomic(gc, size);
+    gc_profile_leave(gc, saved);
+    if (!p) {
+        die("Memory allocation failed");
+    }
+    return p;
+}
+
+static void *string_alloc_typed(gc_state *gc, size_t size, const gc_layout *layout, const void *site) {
+    const void *saved = gc_profile_enter(gc, site);
+    void *p = gc_malloc_typed(gc, size, layout);
+    gc_profile_leave(gc, saved);
+    return p;
+}
+
+static void *string_realloc(gc_state *gc, void *ptr, size_t size, const void *site) {
+    const void *saved = gc_profile_enter(gc, site);
+    void *p = gc_realloc(gc, ptr, size);
+    gc_profile_leave(gc, saved);
+    return p;
+}
+
 char *gc_strdup(gc_state *gc, const char *s) {
     if (!s) return NULL;
     size_t len = strlen(s) + 1;
-    char *dup = gc_malloc(gc, len);
-    if (!dup) {
-        die("Memory allocation failed");
-    }
+    char *dup = string_alloc(gc, len, __builtin_return_address(0));
     memcpy(dup, s, len);
     return dup;
 }
@@ -29,47 +54,184 @@ char *gc_asprintf(gc_state *gc, const char *fmt, ...) {
         return NULL;
     }
     
-    char *str = gc_malloc(gc, len + 1);
-    if (!str) {
-        va_end(args);
-        die("Memory allocation failed");
-    }
-    
+    char *str = string_alloc(gc, len + 1, __builtin_return_address(0));
     vsnprintf(str, len + 1, fmt, args);
     va_end(args);
     
     return str;
 }
 
+string_view_t string_view(const char *ptr, size_t len) {
+    return (string_view_t){ .ptr = ptr, .len = len };
+}
+
+string_view_t string_view_from_str(const char *str) {
+    return string_view(str, strlen(str));
+}
+
+string_view_t string_view_slice(string_view_t v, size_t start, size_t end) {
+    if (end > v.len) end = v.len;
+    if (start > end) start = end;
+    return string_view(v.ptr + start, end - start);
+}
+
+bool string_view_equals(string_view_t v, const char *str) {
+    size_t len = strlen(str);
+    return v.len == len && memcmp(v.ptr, str, len) == 0;
+}
+
+bool string_view_starts_with(string_view_t v, const char *prefix) {
+    size_t len = strlen(prefix);
+    return v.len >= len && memcmp(v.ptr, prefix, len) == 0;
+}
+
+size_t string_view_find_char(string_view_t v, char c) {
+    const char *hit = memchr(v.ptr, c, v.len);
+    return hit ? (size_t)(hit - v.ptr) : SIZE_MAX;
+}
+
+size_t string_view_find(string_view_t v, const char *needle) {
+    size_t len = strlen(needle);
+    if (len == 0) return 0;
+    // Candidates start at the needle's first byte
+    for (size_t i = 0; i + len <= v.len;) {
+        size_t hit = string_view_find_char(string_view_slice(v, i, v.len - len + 1), needle[0]);
+        if (hit == SIZE_MAX) break;
+        i += hit;
+        if (memcmp(v.ptr + i, needle, len) == 0) return i;
+        i++;
+    }
+    return SIZE_MAX;
+}
+
+char *string_view_dup(gc_state *gc, string_view_t v) {
+    char *dup = string_alloc(gc, v.len + 1, __builtin_return_address(0));
+    memcpy(dup, v.ptr, v.len);
+    dup[v.len] = '\0';
+    return dup;
+}
+
+// Intern table: open addressing over entries that keep the length and
+// hash, with the strings themselves packed into malloc'd chunks
+#define INTERN_INITIAL_SLOTS 256
+#define INTERN_CHUNK_SIZE 16384
+
+typedef struct {
+    const char *str;  // NULL for an empty slot
+    size_t len;
+    size_t hash;
+} intern_entry;
+
+static intern_entry *intern_slots;
+static size_t intern_count;
+static size_t intern_capacity;  // Power of two
+static char *intern_chunk;
+static size_t intern_chunk_left;
+
+static size_t intern_hash(string_view_t v) {
+    size_t h = 14695981039346656037ULL;  // FNV-1a
+    for (size_t i = 0; i < v.len; i++) {
+        h = (h ^ (unsigned char)v.ptr[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static void intern_grow(void) {
+    size_t capacity = intern_capacity ? intern_capacity * 2 : INTERN_INITIAL_SLOTS;
+    intern_entry *slots = calloc(capacity, sizeof(intern_entry));
+    if (!slots) {
+        die("Memory allocation failed");
+    }
+    for (size_t i = 0; i < intern_capacity; i++) {
+        if (!intern_slots[i].str) continue;
+        size_t k = intern_slots[i].hash & (capacity - 1);
+        while (slots[k].str) k = (k + 1) & (capacity - 1);
+        slots[k] = intern_slots[i];
+    }
+    free(intern_slots);
+    intern_slots = slots;
+    intern_capacity = capacity;
+}
+
+static const char *intern_copy(string_view_t v) {
+    if (v.len + 1 > intern_chunk_left) {
+        // The tail of the old chunk is abandoned, strings never move
+        size_t size = v.len + 1 > INTERN_CHUNK_SIZE ? v.len + 1 : INTERN_CHUNK_SIZE;
+        intern_chunk = malloc(size);
+        if (!intern_chunk) {
+            die("Memory allocation failed");
+        }
+        intern_chunk_left = size;
+    }
+    char *copy = intern_chunk;
+    memcpy(copy, v.ptr, v.len);
+    copy[v.len] = '\0';
+    intern_chunk += v.len + 1;
+    intern_chunk_left -= v.len + 1;
+    return copy;
+}
+
+const char *string_intern_view(string_view_t v) {
+    // Kept at most three quarters full
+    if ((intern_count + 1) * 4 > intern_capacity * 3) {
+        intern_grow();
+    }
+    size_t hash = intern_hash(v);
+    size_t k = hash & (intern_capacity - 1);
+    while (intern_slots[k].str) {
+        intern_entry *e = &intern_slots[k];
+        if (e->hash == hash && e->len == v.len && memcmp(e->str, v.ptr, v.len) == 0) {
+            return e->str;
+        }
+        k = (k + 1) & (intern_capacity - 1);
+    }
+    intern_slots[k] = (intern_entry){ intern_copy(v), v.len, hash };
+    intern_count++;
+    return intern_slots[k].str;
+}
+
+const char *string_intern(const char *str) {
+    return str ? string_intern_view(string_view_from_str(str)) : NULL;
+}
+
 void string_builder_init(string_builder_t *sb, gc_state *gc, size_t initial_capacity) {
     sb->gc = gc;
-    sb->data = gc_malloc(gc, initial_capacity);
+    sb->data = string_alloc(gc, initial_capacity, __builtin_return_address(0));
     sb->data[0] = '\0';
     sb->size = 0;
     sb->capacity = initial_capacity;
 }
 
-void string_builder_append(string_builder_t *sb, const char *data, size_t len) {
+// Room for len more bytes and the terminator
+static void builder_reserve(string_builder_t *sb, size_t len, const void *site) {
     size_t new_size = sb->size + len;
-    
     if (new_size + 1 > sb->capacity) {
         size_t new_capacity = sb->capacity * 2;
         while (new_capacity < new_size + 1) {
             new_capacity *= 2;
         }
-        char *new_data = gc_malloc(sb->gc, new_capacity);
-        memcpy(new_data, sb->data, sb->size + 1);  // +1 for null terminator
-        sb->data = new_data;
+        sb->data = string_realloc(sb->gc, sb->data, new_capacity, site);
         sb->capacity = new_capacity;
     }
-    
+}
+
+static void builder_append(string_builder_t *sb, const char *data, size_t len, const void *site) {
+    builder_reserve(sb, len, site);
     memcpy(sb->data + sb->size, data, len);
-    sb->size = new_size;
+    sb->size += len;
     sb->data[sb->size] = '\0';
 }
 
+void string_builder_append(string_builder_t *sb, const char *data, size_t len) {
+    builder_append(sb, data, len, __builtin_return_address(0));
+}
+
 void string_builder_append_str(string_builder_t *sb, const char *str) {
-    string_builder_append(sb, str, strlen(str));
+    builder_append(sb, str, strlen(str), __builtin_return_address(0));
+}
+
+void string_builder_append_view(string_builder_t *sb, string_view_t v) {
+    builder_append(sb, v.ptr, v.len, __builtin_return_address(0));
 }
 
 void string_builder_append_fmt(string_builder_t *sb, const char *fmt, ...) {
@@ -86,25 +248,158 @@ void string_builder_append_fmt(string_builder_t *sb, const char *fmt, ...) {
         return;
     }
     
-    size_t new_size = sb->size + len;
+    builder_reserve(sb, len, __builtin_return_address(0));
+    vsnprintf(sb->data + sb->size, len + 1, fmt, args);
+    sb->size += len;
     
-    if (new_size + 1 > sb->capacity) {
-        size_t new_capacity = sb->capacity * 2;
-        while (new_capacity < new_size + 1) {
-            new_capacity *= 2;
+    va_end(args);
+}
+
+char *string_builder_finalize(string_builder_t *sb) {
+    return sb->data;
+}
+
+// Only the data pointers are traced, mapped files are not gc memory anyway
+static const gc_layout rope_segment_layout = {
+    .size = sizeof(rope_segment_t),
+    .ptr_words = GC_LAYOUT_FIELD(rope_segment_t, data),
+};
+
+void rope_init(rope_t *r, gc_state *gc) {
+    r->gc = gc;
+    r->segments = NULL;
+    r->count = 0;
+    r->capacity = 0;
+    r->size = 0;
+}
+
+// site is the public function's caller, for the heap profile
+static void rope_push(rope_t *r, const char *data, size_t len, bool mapped, bool file, const void *site) {
+    if (len == 0 && !mapped) return;
+    if (r->count == r->capacity) {
+        if (!r->segments) {
+            r->capacity = 16;
+            r->segments = string_alloc_typed(r->gc, r->capacity * sizeof(rope_segment_t), &rope_segment_layout, site);
+        } else {
+            r->capacity *= 2;
+            r->segments = string_realloc(r->gc, r->segments, r->capacity * sizeof(rope_segment_t), site);
         }
-        char *new_data = gc_malloc(sb->gc, new_capacity);
-        memcpy(new_data, sb->data, sb->size + 1);  // +1 for null terminator
-        sb->data = new_data;
-        sb->capacity = new_capacity;
     }
+    r->segments[r->count++] = (rope_segment_t){ .data = data, .len = len, .mapped = mapped, .file = file };
+    r->size += len;
+}
+
+void rope_append_ref(rope_t *r, const char *data, size_t len) {
+    rope_push(r, data, len, false, false, __builtin_return_address(0));
+}
+
+void rope_append_str(rope_t *r, const char *str) {
+    rope_push(r, str, strlen(str), false, false, __builtin_return_address(0));
+}
+
+void rope_append_fmt(rope_t *r, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
     
-    vsnprintf(sb->data + sb->size, len + 1, fmt, args);
-    sb->size = new_size;
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int len = vsnprintf(NULL, 0, fmt, args_copy);
+    va_end(args_copy);
     
+    if (len < 0) {
+        va_end(args);
+        return;
+    }
+    
+    char *str = string_alloc(r->gc, len + 1, __builtin_return_address(0));
+    vsnprintf(str, len + 1, fmt, args);
     va_end(args);
+    
+    rope_push(r, str, len, false, false, __builtin_return_address(0));
 }
 
-char *string_builder_finalize(string_builder_t *sb) {
-    return sb->data;
-}
\ No newline at end of file
+static void rope_push_slice(rope_t *r, const rope_t *other, size_t start, size_t end, const void *site);
+
+void rope_append_rope(rope_t *r, const rope_t *other) {
+    rope_push_slice(r, other, 0, other->size, __builtin_return_address(0));
+}
+
+bool rope_append_file(rope_t *r, const char *path, char **error) {
+    size_t size;
+    bool mapped;
+    const char *data = file_map(path, &size, &mapped, error);
+    if (!data) return false;
+    rope_push(r, data, size, mapped, mapped, __builtin_return_address(0));
+    return true;
+}
+
+size_t rope_rfind_char(const rope_t *r, size_t end, char c) {
+    size_t seg_start = r->size;
+    for (size_t i = r->count; i-- > 0;) {
+        const rope_segment_t *seg = &r->segments[i];
+        seg_start -= seg->len;
+        if (seg_start >= end) continue;
+        size_t n = end - seg_start < seg->len ? end - seg_start : seg->len;
+        if (seg->file) {
+            // Through copies, in case the file was truncated since it was
+            // mapped. Bytes that can't be read are treated as gone.
+            char chunk[4096];
+            for (size_t hi = n; hi > 0;) {
+                size_t lo = hi > sizeof(chunk) ? hi - sizeof(chunk) : 0;
+                size_t k = file_map_copy(chunk, seg->data + lo, hi - lo);
+                while (k-- > 0) {
+                    if (chunk[k] == c) return seg_start + lo + k;
+                }
+                hi = lo;
+            }
+            continue;
+        }
+        while (n-- > 0) {
+            if (seg->data[n] == c) return seg_start + n;
+        }
+    }
+    return SIZE_MAX;
+}
+
+static void rope_push_slice(rope_t *r, const rope_t *other, size_t start, size_t end, const void *site) {
+    size_t seg_start = 0;
+    // Ownership of mappings stays with other
+    for (size_t i = 0; i < other->count && seg_start < end; i++) {
+        const rope_segment_t *seg = &other->segments[i];
+        size_t seg_end = seg_start + seg->len;
+        if (seg_end > start) {
+            size_t from = start > seg_start ? start - seg_start : 0;
+            size_t to = end < seg_end ? end - seg_start : seg->len;
+            rope_push(r, seg->data + from, to - from, false, seg->file, site);
+        }
+        seg_start = seg_end;
+    }
+}
+
+void rope_append_slice(rope_t *r, const rope_t *other, size_t start, size_t end) {
+    rope_push_slice(r, other, start, end, __builtin_return_address(0));
+}
+
+char *rope_flatten(const rope_t *r) {
+    char *str = string_alloc(r->gc, r->size + 1, __builtin_return_address(0));
+    char *p = str;
+    for (size_t i = 0; i < r->count; i++) {
+        const rope_segment_t *seg = &r->segments[i];
+        if (seg->file) {
+            // A file truncated since it was mapped comes out shorter
+            p += file_map_copy(p, seg->data, seg->len);
+        } else {
+            memcpy(p, seg->data, seg->len);
+            p += seg->len;
+        }
+    }
+    *p = '\0';
+    return str;
+}
+
+void rope_release(rope_t *r) {
+    for (size_t i = 0; i < r->count; i++) {
+        if (r->segments[i].mapped) file_unmap(r->segments[i].data, r->segments[i].len);
+    }
+    rope_init(r, r->gc);
+}
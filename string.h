@@ -6,16 +6,62 @@
 
 /**
  * Duplicate string, die on failure.
+ * The copy is atomic gc memory (never scanned for pointers).
  */
 char *gc_strdup(gc_state *gc, const char *s);
 
 /**
  * Allocate and format string (like asprintf).
+ * The result is atomic gc memory (never scanned for pointers).
  */
 char *gc_asprintf(gc_state *gc, const char *fmt, ...);
 
+/**
+ * Non-owning view of len bytes at ptr, not NUL-terminated. Valid as long
+ * as the memory it points into; parsers hand out views instead of copying
+ * substrings and only copy what they keep.
+ */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} string_view_t;
+
+string_view_t string_view(const char *ptr, size_t len);
+string_view_t string_view_from_str(const char *str);
+
+/**
+ * Bytes [start, end) of a view, clamped to its length.
+ */
+string_view_t string_view_slice(string_view_t v, size_t start, size_t end);
+
+bool string_view_equals(string_view_t v, const char *str);
+bool string_view_starts_with(string_view_t v, const char *prefix);
+
+/**
+ * Offset of the first c or needle in the view, SIZE_MAX if there is none.
+ */
+size_t string_view_find_char(string_view_t v, char c);
+size_t string_view_find(string_view_t v, const char *needle);
+
+/**
+ * Copy a view into a NUL-terminated string (atomic gc memory).
+ */
+char *string_view_dup(gc_state *gc, string_view_t v);
+
+/**
+ * Interned strings: one immutable copy of each distinct string, so equal
+ * interned strings are the same pointer and compare with ==. The copies
+ * live until exit in malloc memory the gc never scans or frees, which
+ * also means they need no escaping from allocation regions. Meant for
+ * small recurring sets such as paths and the working directory. Call
+ * from one thread at a time.
+ */
+const char *string_intern(const char *str);  // NULL stays NULL
+const char *string_intern_view(string_view_t v);
+
 /**
  * String builder for efficient string concatenation
+ * The buffer is atomic gc memory, so only character data may be stored in it.
  */
 typedef struct {
     char *data;
@@ -27,7 +73,61 @@ typedef struct {
 void string_builder_init(string_builder_t *sb, gc_state *gc, size_t initial_capacity);
 void string_builder_append(string_builder_t *sb, const char *data, size_t len);
 void string_builder_append_str(string_builder_t *sb, const char *str);
+void string_builder_append_view(string_builder_t *sb, string_view_t v);
 void string_builder_append_fmt(string_builder_t *sb, const char *fmt, ...);
 char *string_builder_finalize(string_builder_t *sb);
 
+/**
+ * Rope: a string kept as a list of segments that point into existing
+ * buffers (string literals, gc strings, mapped files) instead of copying
+ * them. Large pieces are copied once, when the rope is flattened.
+ * Referenced buffers must outlive the rope. Files added with
+ * rope_append_file (when large enough to be mapped) belong to the rope
+ * that mapped them and are unmapped
+ * by rope_release; ropes sharing its segments must be flattened first.
+ */
+typedef struct {
+    const char *data;
+    size_t len;
+    bool mapped;    // A file mapping this rope owns
+    bool file;      // Points into a file mapping, this rope's or another's
+} rope_segment_t;
+
+typedef struct {
+    rope_segment_t *segments;  // gc memory, traced through a layout
+    size_t count;
+    size_t capacity;
+    size_t size;               // Total length in bytes
+    gc_state *gc;
+} rope_t;
+
+void rope_init(rope_t *r, gc_state *gc);
+void rope_append_ref(rope_t *r, const char *data, size_t len);
+void rope_append_str(rope_t *r, const char *str);
+void rope_append_fmt(rope_t *r, const char *fmt, ...);
+void rope_append_rope(rope_t *r, const rope_t *other);
+bool rope_append_file(rope_t *r, const char *path, char **error);
+
+/**
+ * Offset of the last c before offset end, or SIZE_MAX if there is none.
+ */
+size_t rope_rfind_char(const rope_t *r, size_t end, char c);
+
+/**
+ * Append bytes [start, end) of another rope, sharing its buffers.
+ */
+void rope_append_slice(rope_t *r, const rope_t *other, size_t start, size_t end);
+
+/**
+ * Copy the rope into one NUL-terminated string (atomic gc memory). Mapped
+ * files are read with file_map_copy, so one truncated in the meantime
+ * leaves the string shorter than r->size.
+ */
+char *rope_flatten(const rope_t *r);
+
+/**
+ * Unmap the files the rope owns. The rope is left empty.
+ */
+void rope_release(rope_t *r);
+
 #endif /* STRING_H */
\ No newline at end of file
@@ -0,0 +1,277 @@
+// GC smoke test: exercises the collector paths that are easiest to get
+// wrong (conservative marking, gc_realloc and gc_free, region escape and
+// compaction forwarding) and checks the heap by its contents and through
+// weak references. Exits with status 1 on the first failed check.
+//
+// Usage: gc_check
+// MINICODER_DEBUG_STRESS_GC=1, MINICODER_GC_BACKGROUND_SWEEP=1,
+// MINICODER_GC_INCREMENTAL and MINICODER_GC_MARK_THREADS configure the
+// collector as in minicoder.
+
+#include "gc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+gc_state gc;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "gc_check: %s:%d: %s failed\n", __func__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+#define GARBAGE 1000
+
+typedef struct node {
+    struct node *next;
+    char *label;
+    size_t value;
+} node;
+
+static const gc_layout node_layout = {
+    .size = sizeof(node),
+    .ptr_words = GC_LAYOUT_FIELD(node, next) | GC_LAYOUT_FIELD(node, label),
+};
+
+static void *roots[4];              // Registered with gc_add_root
+static gc_weak *weaks[GARBAGE];     // Weak references into the heap
+
+// Typed node whose label reads "v<value>"
+static node *new_node(size_t value, node *next) {
+    node *n = gc_malloc_typed(&gc, sizeof(node), &node_layout);
+    n->label = gc_malloc_atomic(&gc, 24);
+    snprintf(n->label, 24, "v%zu", value);
+    n->value = value;
+    n->next = next;
+    return n;
+}
+
+static bool node_ok(const node *n) {
+    char label[24];
+    snprintf(label, sizeof(label), "v%zu", n->value);
+    return strcmp(n->label, label) == 0;
+}
+
+// Run a full collection that marks the heap as it is now. gc_collect only
+// finishes a cycle already in progress (incremental, or sweeping in the
+// background), so it takes two.
+static void collect(void) {
+    gc_collect(&gc);
+    gc_collect(&gc);
+}
+
+// Allocate objects that nothing points at, leaving weak references to them
+static __attribute__((noinline)) void make_garbage(void) {
+    for (size_t i = 0; i < GARBAGE; i++)
+        weaks[i] = gc_weak_new(&gc, gc_malloc(&gc, 32 + i % 200));
+}
+
+static size_t count_cleared(void) {
+    size_t cleared = 0;
+    for (size_t i = 0; i < GARBAGE; i++)
+        if (!gc_weak_get(weaks[i])) cleared++;
+    return cleared;
+}
+
+// Objects reachable from the stack, roots and other objects survive, even
+// through interior pointers; unreachable ones are freed.
+static __attribute__((noinline)) void check_conservative_marking(void) {
+    char *volatile on_stack = gc_malloc(&gc, 100);
+    memset(on_stack, 's', 100);
+    char *block = gc_malloc(&gc, 5000);
+    memset(block, 'i', 5000);
+    char *volatile interior = block + 2500;
+    block = NULL;
+    char **in_root = gc_malloc(&gc, 2 * sizeof(char*));
+    roots[0] = in_root;
+    in_root[1] = gc_malloc_atomic(&gc, 200000);
+    memset(in_root[1], 'r', 200000);
+    in_root = NULL;
+
+    make_garbage();
+    collect();
+    gc_collect_minor(&gc);
+
+    // A stale copy of a pointer may keep the odd object alive
+    CHECK(count_cleared() >= GARBAGE * 9 / 10);
+    CHECK(on_stack[0] == 's' && on_stack[99] == 's');
+    CHECK(interior[-2500] == 'i' && interior[2499] == 'i');
+    char **kept = roots[0];
+    CHECK(kept[1][0] == 'r' && kept[1][199999] == 'r');
+    roots[0] = NULL;
+}
+
+static bool zeroed(const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (p[i]) return false;
+    return true;
+}
+
+// Resize through sizes, filling each size with non-zero bytes so a grow
+// that brings back what an earlier shrink gave up shows
+static char *resize(char *p, size_t old_size, const size_t *sizes, size_t count) {
+    for (size_t k = 0; k < count; k++) {
+        p = gc_realloc(&gc, p, sizes[k]);
+        CHECK(memcmp(p, "1234567", 8) == 0);
+        if (sizes[k] > old_size) CHECK(zeroed(p + old_size, sizes[k] - old_size));
+        memset(p + 8, 0xa5, sizes[k] - 8);
+        old_size = sizes[k];
+    }
+    return p;
+}
+
+// Contents, flags and layouts survive resizing across size classes, memory
+// past the old size is zeroed even after shrinking, and gc_free gives
+// memory back at once.
+static __attribute__((noinline)) void check_realloc_free(void) {
+    // Through slots, a large mapping and back, shrinking in place each time
+    char *p = gc_malloc(&gc, 8);
+    memcpy(p, "1234567", 8);
+    static const size_t sizes[] = { 100, 3000, 100, 2000, 100000, 16, 60000, 5000 };
+    p = resize(p, 8, sizes, sizeof(sizes) / sizeof(sizes[0]));
+
+    // A malloc'd block in the table
+    char *q = gc_malloc(&gc, 5000);
+    memcpy(q, "1234567", 8);
+    static const size_t table_sizes[] = { 5000, 100, 4000 };
+    resize(q, 5000, table_sizes, sizeof(table_sizes) / sizeof(table_sizes[0]));
+
+    // A region object, last in its chunk and not
+    gc_region_begin(&gc);
+    char *r = gc_malloc(&gc, 200);
+    memcpy(r, "1234567", 8);
+    static const size_t region_sizes[] = { 200, 50, 150 };
+    r = resize(r, 200, region_sizes, sizeof(region_sizes) / sizeof(region_sizes[0]));
+    gc_malloc(&gc, 16);
+    r = resize(r, 150, region_sizes + 1, 2);
+    gc_region_end(&gc);
+
+    node *n = gc_realloc(&gc, new_node(1, NULL), 64 * sizeof(node));
+    n[63].next = new_node(2, NULL);
+    gc_weak *next = gc_weak_new(&gc, n[63].next);
+    collect();
+    CHECK(node_ok(&n[0]) && gc_weak_get(next) && node_ok(n[63].next));
+
+    // While a collection is in progress the block is left for the sweep
+    char *big = gc_malloc_atomic(&gc, 100000);
+    size_t with_big = gc_allocated_bytes(&gc);
+    bool idle = gc.cycle.phase == GC_PHASE_IDLE;
+    gc_free(&gc, big);
+    if (idle) CHECK(gc_allocated_bytes(&gc) <= with_big - 100000);
+
+    // Pointers that don't start a gc allocation are ignored
+    char local;
+    gc_free(&gc, &local);
+    gc_free(&gc, p + 1);
+    gc_free(&gc, NULL);
+    collect();
+    CHECK(memcmp(p, "1234567", 8) == 0);
+}
+
+// Escaped copies keep their contents and layout once the region is gone,
+// from nested regions too.
+static __attribute__((noinline)) void check_region_escape(void) {
+    node *outside = new_node(7, NULL);
+    node *kept = NULL;
+    gc_region_begin(&gc);
+    node *outer = NULL;
+    for (size_t round = 0; round < 3; round++) {
+        gc_region_begin(&gc);
+        node *list = NULL;
+        for (size_t i = 0; i < 500; i++) {
+            list = new_node(i, list);
+            if (i % 100 == 0) {
+                node *e = gc_region_escape(&gc, list);
+                e->label = gc_region_escape(&gc, list->label);
+                e->next = outer;
+                outer = e;
+            }
+        }
+        CHECK(gc_region_escape(&gc, outside) == outside);
+        gc_region_end(&gc);
+        collect();
+    }
+    for (node *n = outer; n; n = n->next) {
+        node *e = gc_region_escape(&gc, n);
+        e->label = gc_region_escape(&gc, n->label);
+        e->next = kept;
+        kept = e;
+    }
+    gc_region_end(&gc);
+
+    // The heap copies only stay alive through their typed next pointers
+    gc_weak *last = gc_weak_new(&gc, kept->next->next);
+    collect();
+    size_t count = 0;
+    for (node *n = kept; n; n = n->next, count++) CHECK(node_ok(n));
+    CHECK(count == 15 && gc_weak_get(last));
+    CHECK(node_ok(outside));
+}
+
+// Objects moved off sparse pages are found at their new addresses through
+// typed pointers and weak references.
+static __attribute__((noinline)) void check_compaction(void) {
+    gc.compact = true;
+    size_t moved = gc.stats.moved_objects;
+    // Enough nodes for several pages per class, too many to collect on every
+    // allocation in stress mode
+    int stress = gc.debug_stress;
+    gc.debug_stress = 0;
+    node *head = NULL;
+    for (size_t i = 0; i < 20000; i++) head = new_node(i, head);
+    roots[1] = head;
+    gc.debug_stress = stress;
+    collect();
+
+    // Leave the older half of the pages sparse and the newer half half
+    // full, which gives compaction room once the next sweep has run
+    size_t kept = 0, weak_value = 0;
+    for (node *n = head; n; n = n->next, kept++) {
+        size_t drop = n->value >= 10000 ? 1 : 8;
+        for (size_t k = 0; k < drop && n->next; k++) n->next = n->next->next;
+        if (!roots[2] && n->value < 10000) {
+            roots[2] = gc_weak_new(&gc, n);
+            weak_value = n->value;
+        }
+    }
+    head = NULL;
+    collect();
+    collect();
+
+    size_t count = 0;
+    for (node *n = roots[1]; n; n = n->next, count++) CHECK(node_ok(n));
+    CHECK(count == kept);
+    node *target = gc_weak_get(roots[2]);
+    CHECK(target && target->value == weak_value && node_ok(target));
+    CHECK(gc.stats.moved_objects > moved);
+    gc.compact = false;
+    roots[1] = roots[2] = NULL;
+}
+
+int main(void) {
+    void *stack_bottom;
+    GC_GET_STACK_POINTER(&stack_bottom);
+    gc_init(&gc, stack_bottom);
+    const char *stress_env = getenv("MINICODER_DEBUG_STRESS_GC");
+    if (stress_env && strcmp(stress_env, "1") == 0) gc.debug_stress = 1;
+    const char *sweep_env = getenv("MINICODER_GC_BACKGROUND_SWEEP");
+    if (sweep_env && strcmp(sweep_env, "1") == 0) gc.background_sweep = true;
+    const char *incremental_env = getenv("MINICODER_GC_INCREMENTAL");
+    if (incremental_env && atoi(incremental_env) > 0) gc.incremental_step_us = (unsigned)atoi(incremental_env);
+    const char *mark_threads_env = getenv("MINICODER_GC_MARK_THREADS");
+    if (mark_threads_env && atoi(mark_threads_env) > 1) gc.mark_threads = (unsigned)atoi(mark_threads_env);
+    gc_add_root(&gc, roots, sizeof(roots));
+    gc_add_root(&gc, weaks, sizeof(weaks));
+
+    // The checks don't inline, main's frame lies above the stack bottom
+    check_conservative_marking();
+    check_realloc_free();
+    check_region_escape();
+    check_compaction();
+
+    gc_cleanup(&gc);
+    printf("gc_check: ok\n");
+    return 0;
+}
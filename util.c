@@ -8,6 +8,11 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -58,9 +63,9 @@ char *file_to_string(const char *path, char **error) {
         return NULL;
     }
     
-    // Allocate buffer for entire file
+    // Allocate buffer for entire file (pointer-free, never scanned by the gc)
     size_t size = st.st_size;
-    char *buffer = gc_malloc(&gc, size + 1);
+    char *buffer = gc_malloc_atomic(&gc, size + 1);
     
     // Read entire file in one go
     size_t bytes_read = fread(buffer, 1, size, fp);
@@ -77,6 +82,134 @@ char *file_to_string(const char *path, char **error) {
     return buffer;
 }
 
+// Files smaller than this are read, a mapping isn't worth its setup then
+#define FILE_MAP_MIN_SIZE (64 * 1024)
+
+const char *file_map(const char *path, size_t *size, bool *mapped, char **error) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (error) {
+            *error = gc_asprintf(&gc, "Failed to open file '%s': %s", path, strerror(errno));
+        }
+        return NULL;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        if (error) {
+            *error = gc_asprintf(&gc, "Failed to stat file '%s': %s", path, strerror(errno));
+        }
+        close(fd);
+        return NULL;
+    }
+    
+    if (S_ISREG(st.st_mode) && (size_t)st.st_size >= FILE_MAP_MIN_SIZE) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            if (error) {
+                *error = gc_asprintf(&gc, "Failed to map file '%s': %s", path, strerror(errno));
+            }
+            return NULL;
+        }
+        *size = st.st_size;
+        *mapped = true;
+        return data;
+    }
+    
+    // Small files, and pipes and /proc files whose size says nothing, are
+    // read to the end
+    string_builder_t sb;
+    string_builder_init(&sb, &gc, S_ISREG(st.st_mode) ? (size_t)st.st_size + 1 : 4096);
+    char buffer[16384];
+    for (;;) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (error) {
+                *error = gc_asprintf(&gc, "Failed to read file '%s': %s", path, strerror(errno));
+            }
+            close(fd);
+            return NULL;
+        }
+        string_builder_append(&sb, buffer, n);
+    }
+    close(fd);
+    *size = sb.size;
+    *mapped = false;
+    return string_builder_finalize(&sb);
+}
+
+void file_unmap(const char *data, size_t size) {
+    if (size > 0) {
+        munmap((void *)data, size);
+    }
+}
+
+// The copy in progress on this thread, for the SIGBUS handler
+static __thread sigjmp_buf *volatile map_fault_jmp;
+static __thread const char *volatile map_fault_addr;
+
+// Installed once for the whole process, faults outside a copy go to the
+// action it replaced
+static pthread_once_t map_fault_once = PTHREAD_ONCE_INIT;
+static struct sigaction map_fault_old;
+
+static void map_fault_handler(int sig, siginfo_t *info, void *context) {
+    if (!map_fault_jmp) {
+        if (map_fault_old.sa_flags & SA_SIGINFO) {
+            map_fault_old.sa_sigaction(sig, info, context);
+        } else if (map_fault_old.sa_handler == SIG_DFL) {
+            // Die of the signal as if we had never been installed
+            sigaction(sig, &map_fault_old, NULL);
+            raise(sig);
+        } else if (map_fault_old.sa_handler != SIG_IGN) {
+            map_fault_old.sa_handler(sig);
+        }
+        return;
+    }
+    map_fault_addr = info->si_addr;
+    siglongjmp(*map_fault_jmp, 1);
+}
+
+static void map_fault_install(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = map_fault_handler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;  // So jumping out leaves it unblocked
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, &map_fault_old);
+}
+
+size_t file_map_copy(char *dst, const char *src, size_t len) {
+    if (len == 0) return 0;
+    pthread_once(&map_fault_once, map_fault_install);
+    
+    sigjmp_buf jmp;
+    volatile size_t n = len;
+    volatile bool faulted = false;
+    if (sigsetjmp(jmp, 0) != 0) {
+        // memcpy may copy out of order, so redo everything before the
+        // page that faulted; pages past the new end of file all fault
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        uintptr_t page = (uintptr_t)map_fault_addr & ~(uintptr_t)(page_size - 1);
+        size_t readable = page > (uintptr_t)src ? page - (uintptr_t)src : 0;
+        n = readable < n ? readable : 0;
+        faulted = true;
+    }
+    map_fault_jmp = &jmp;
+    memcpy(dst, src, n);
+    map_fault_jmp = NULL;
+    
+    // The last page reads as zeros past the new end of file
+    size_t copied = n;
+    if (faulted) {
+        while (copied > 0 && dst[copied - 1] == '\0') copied--;
+    }
+    return copied;
+}
+
 int is_binary_file(const char *path, char **error) {
     FILE *file = fopen(path, "rb");
     if (!file) {
@@ -168,10 +301,10 @@ int expand_globs(const char *words, expand_globs_t *result) {
     result->we_wordc = 0;
     result->we_wordv = NULL;
     
-    // Work directly with the input string using indices to avoid GC rooting issues
-    size_t len = strlen(words);
-    char *buffer = gc_malloc(&gc, len + 1);
-    strcpy(buffer, words);
+    // Work directly on the input, words are built from runs of it
+    string_view_t input = string_view_from_str(words);
+    const char *buffer = input.ptr;
+    size_t len = input.len;
     size_t pos = 0;
     
     // Dynamic array for words
@@ -201,17 +334,16 @@ int expand_globs(const char *words, expand_globs_t *result) {
             string_builder_init(&word_sb, &gc, 64);
             
             // Find matching quote and unescape
+            size_t run = pos;
             while (pos < len && buffer[pos] && buffer[pos] != quote_char) {
                 if (buffer[pos] == '\\' && pos + 1 < len && buffer[pos + 1]) {
-                    // Add the escaped character (skip the backslash)
-                    pos++;
-                    string_builder_append(&word_sb, &buffer[pos], 1);
-                    pos++;
-                } else {
-                    string_builder_append(&word_sb, &buffer[pos], 1);
-                    pos++;
+                    // Add the run so far, the escaped character starts the next
+                    string_builder_append_view(&word_sb, string_view(buffer + run, pos - run));
+                    run = ++pos;
                 }
+                pos++;
             }
+            string_builder_append_view(&word_sb, string_view(buffer + run, pos - run));
             
             if (pos < len && buffer[pos] == quote_char) {
                 pos++;
@@ -231,17 +363,16 @@ int expand_globs(const char *words, expand_globs_t *result) {
             string_builder_init(&word_sb, &gc, 64);
             
             // Find end of unquoted word
+            size_t run = pos;
             while (pos < len && buffer[pos] && buffer[pos] != ' ' && buffer[pos] != '\t' && buffer[pos] != '\n') {
                 if (buffer[pos] == '\\' && pos + 1 < len && buffer[pos + 1]) {
-                    // Add the escaped character (skip the backslash)
-                    pos++;
-                    string_builder_append(&word_sb, &buffer[pos], 1);
-                    pos++;
-                } else {
-                    string_builder_append(&word_sb, &buffer[pos], 1);
-                    pos++;
+                    // Add the run so far, the escaped character starts the next
+                    string_builder_append_view(&word_sb, string_view(buffer + run, pos - run));
+                    run = ++pos;
                 }
+                pos++;
             }
+            string_builder_append_view(&word_sb, string_view(buffer + run, pos - run));
             
             // Get the unescaped word
             char *unescaped_word = string_builder_finalize(&word_sb);
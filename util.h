@@ -24,6 +24,23 @@ int file_exists(const char *path);
  */
 char *file_to_string(const char *path, char **error);
 
+/**
+ * Get a file's contents for callers that only look at them. Regular files
+ * of 64KB or more are mapped read-only (*mapped set, release with
+ * file_unmap); others are read into atomic gc memory. Returns the data and
+ * sets *size, or NULL on failure with *error set as for file_to_string.
+ * The data is not NUL-terminated. Read mappings with file_map_copy.
+ */
+const char *file_map(const char *path, size_t *size, bool *mapped, char **error);
+void file_unmap(const char *data, size_t size);
+
+/**
+ * memcpy from a file mapping. A file truncated after it was mapped faults
+ * past its new end; the copy stops at that page instead of dying on SIGBUS.
+ * Returns the number of bytes copied.
+ */
+size_t file_map_copy(char *dst, const char *src, size_t len);
+
 /**
  * Check if a file appears to be binary.
  * Returns 1 if binary, 0 if text, -1 on error.